@@ -1,5 +1,6 @@
 #include <inc/x86.h>
 #include <inc/elf.h>
+#include <inc/multiboot.h>
 
 /**********************************************************************
  * This a dirt simple boot loader, whose sole job is to boot
@@ -26,11 +27,14 @@
  *  * control starts in boot.S -- which sets up protected mode,
  *    and a stack so C code then run, then calls bootmain()
  *
- *  * bootmain() in this file takes over, reads in the kernel and jumps to it.
+ *  * bootmain() in this file takes over, reads in the kernel and jumps to it,
+ *    passing it the memory map boot.S got from the BIOS the same way a
+ *    Multiboot boot loader would.
  **********************************************************************/
 
 #define SECTSIZE	512
 #define ELFHDR		((struct Elf *) 0x10000) // scratch space
+#define MBINFO		((struct Multiboot_info *) 0x7e00) // just past us
 
 void readsect(void*, uint32_t);
 void readseg(uint32_t, uint32_t, uint32_t);
@@ -55,9 +59,17 @@ bootmain(void)
 		// as the physical address)
 		readseg(ph->p_pa, ph->p_memsz, ph->p_offset);
 
+	// Only the memory map in the Multiboot information is valid.
+	// boot.S left it at BOOT_E820MAP + 4, and its end at BOOT_E820MAP.
+	MBINFO->mi_flags = MULTIBOOT_INFO_MEM_MAP;
+	MBINFO->mi_mmap_addr = BOOT_E820MAP + 4;
+	MBINFO->mi_mmap_length = *(uint16_t *) BOOT_E820MAP - (BOOT_E820MAP + 4);
+
 	// call the entry point from the ELF header
 	// note: does not return!
-	((void (*)(void)) (ELFHDR->e_entry))();
+	asm volatile("jmp *%0"
+		     : : "r" (ELFHDR->e_entry),
+			 "a" (MULTIBOOT_BOOTLOADER_MAGIC), "b" (MBINFO));
 
 bad:
 	outw(0x8A00, 0x8A00);
@@ -483,7 +483,8 @@ Failed to shutdown QEMU.  You might need to 'killall qemu' or
 # Monitors
 #
 
-__all__ += ["save", "stop_breakpoint", "call_on_line", "stop_on_line"]
+__all__ += ["save", "stop_breakpoint", "call_on_line", "stop_on_line",
+            "send_commands"]
 
 def save(path):
     """Return a monitor that writes QEMU's output to path.  If the
@@ -545,3 +546,20 @@ def stop_on_line(regexp):
     def stop(line):
         raise TerminateTest
     return call_on_line(regexp, stop)
+
+def send_commands(prompt, commands):
+    """Returns a monitor that types each of 'commands' into the QEMU
+    console in turn, every time the kernel prints 'prompt', and stops
+    once the prompt comes back after the last command."""
+
+    def setup_send_commands(runner):
+        pending = list(commands)
+        def handle_output(output):
+            if not runner.qemu.output.endswith(prompt):
+                return
+            if not pending:
+                raise TerminateTest
+            runner.qemu.proc.stdin.write((pending.pop(0) + "\n").encode())
+            runner.qemu.proc.stdin.flush()
+        runner.qemu.on_output.append(handle_output)
+    return setup_send_commands
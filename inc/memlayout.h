@@ -17,6 +17,7 @@
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
+#define GD_PCPU0  0x68     // Per-CPU data for CPU 0, after NCPU TSSes
 
 /*
  * Virtual memory map:                                Permissions
@@ -92,6 +93,9 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// Physical address of startup code for non-boot CPUs (APs)
+#define MPENTRY_PADDR	0x7000
+
 // Kernel stack.
 #define KSTACKTOP	KERNBASE
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
@@ -143,5 +147,39 @@
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
 
+/*
+ * Page descriptor structures, mapped at UPAGES.
+ * Read/write to the kernel, read-only to user programs.
+ *
+ * Each struct PageInfo stores metadata for one physical page.
+ * Is it NOT the physical page itself, but there is a one-to-one
+ * correspondence between physical pages and struct PageInfo's.
+ * You can map a struct PageInfo * to the corresponding physical address
+ * with page2pa() in kern/pmap.h.
+ *
+ * The buddy allocator in kern/pmap.c hands out blocks of 2^order
+ * contiguous pages; the PageInfo of a block's first page describes the
+ * whole block.
+ */
+struct PageInfo {
+	// Next and previous blocks on the buddy free list.
+	struct PageInfo *pp_link;
+	struct PageInfo *pp_prev;
+
+	// pp_ref is the count of pointers (usually in page table entries)
+	// to this page, for pages allocated using page_alloc.
+	// Pages allocated at boot time using pmap.c's
+	// boot_alloc do not have valid reference count fields.
+
+	uint16_t pp_ref;
+
+	// log2 of the number of pages in the block this page heads.
+	uint8_t pp_order;
+	// PP_FREE if this page heads a block on a buddy free list.
+	uint8_t pp_flags;
+};
+
+#define PP_FREE		0x01
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -63,8 +63,19 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_PAT		0x080	// PAT index bit, in a PTE (not a PDE)
 #define PTE_G		0x100	// Global
 
+// Page Attribute Table memory types.  A PTE picks PAT entry
+// 4*PTE_PAT + 2*PTE_PCD + PTE_PWT (with each bit taken as 0 or 1).
+#define PAT_UC		0x00	// Uncacheable
+#define PAT_WC		0x01	// Write-Combining
+#define PAT_WT		0x04	// Write-Through
+#define PAT_WP		0x05	// Write-Protected
+#define PAT_WB		0x06	// Write-Back
+#define PAT_UC_MINUS	0x07	// Uncacheable, unless an MTRR says WC
+#define PAT_ENTRY(i, type)	((uint64_t) (type) << ((i) * 8))
+
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
@@ -88,7 +99,10 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_OSXMMEXCPT	0x00000400	// OS Supports Unmasked SIMD Exceptions
+#define CR4_OSFXSR	0x00000200	// OS Supports FXSAVE/FXRSTOR
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
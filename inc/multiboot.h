@@ -0,0 +1,52 @@
+#ifndef JOS_INC_MULTIBOOT_H
+#define JOS_INC_MULTIBOOT_H
+
+// The parts of the Multiboot specification (version 0.6.96) that JOS
+// uses: a Multiboot loader, or JOS's own boot loader, enters the kernel
+// with MULTIBOOT_BOOTLOADER_MAGIC in %eax and the physical address of a
+// struct Multiboot_info in %ebx.
+
+#define MULTIBOOT_HEADER_MAGIC		0x1BADB002
+#define MULTIBOOT_BOOTLOADER_MAGIC	0x2BADB002
+
+// Multiboot_info flags: which fields are valid
+#define MULTIBOOT_INFO_MEMORY		0x001	// mi_mem_lower/upper
+#define MULTIBOOT_INFO_MEM_MAP		0x040	// mi_mmap_*
+
+// Multiboot_mmap types
+#define MULTIBOOT_MEMORY_AVAILABLE	1
+
+// JOS's boot loader collects the BIOS E820 memory map here, as a
+// 16-bit pointer to the end of the map followed by Multiboot_mmap
+// entries.
+#define BOOT_E820MAP			0x8000
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct Multiboot_info {
+	uint32_t mi_flags;
+	uint32_t mi_mem_lower;		// KB of memory from 0
+	uint32_t mi_mem_upper;		// KB of memory from 1MB
+	uint32_t mi_boot_device;
+	uint32_t mi_cmdline;
+	uint32_t mi_mods_count;
+	uint32_t mi_mods_addr;
+	uint32_t mi_syms[4];
+	uint32_t mi_mmap_length;	// Bytes of memory map
+	uint32_t mi_mmap_addr;		// Physical address of the map
+};
+
+// One memory map entry.  mm_size is the size of the rest of the entry,
+// which may be larger than the fields below.
+struct Multiboot_mmap {
+	uint32_t mm_size;
+	uint64_t mm_addr;
+	uint64_t mm_len;
+	uint32_t mm_type;
+} __attribute__((packed));
+
+#endif /* !__ASSEMBLER__ */
+
+#endif	// !JOS_INC_MULTIBOOT_H
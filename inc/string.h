@@ -22,4 +22,67 @@ void *	memfind(const void *s, int c, size_t len);
 
 long	strtol(const char *s, char **endptr, int base);
 
+// Ways for memset, memcpy and memmove to move the bulk of a buffer.
+enum {
+	STR_BYTES = 0,	// rep movsb/stosb
+	STR_WORDS,	// align the destination, then rep movsl/stosl
+	STR_BULK,	// the st_bulk_* hooks (memcpy and zeroing memset only)
+};
+
+// Buffers under STR_SMALL bytes are always moved a byte at a time.
+// Larger ones fall into one of STR_NCLASS size classes, split at
+// STR_MEDIUM and STR_LARGE bytes, each with its own strategy.
+#define STR_SMALL	16
+#define STR_MEDIUM	256
+#define STR_LARGE	4096
+#define STR_NCLASS	3
+#define STR_CLASS(n)	((n) < STR_MEDIUM ? 0 : (n) < STR_LARGE ? 1 : 2)
+
+struct String_tunables {
+	uint8_t st_copy[STR_NCLASS];	// Strategy for memcpy and memmove
+	uint8_t st_set[STR_NCLASS];	// Strategy for memset
+	// STR_BULK implementations.  They may themselves call memcpy
+	// and memset, but only for sizes below STR_LARGE.
+	void (*st_bulk_copy)(void *dst, const void *src, size_t len);
+	void (*st_bulk_zero)(void *dst, size_t len);
+};
+
+extern struct String_tunables string_tunables;
+
+// Copies of 4, 8, 16 or 32 bytes, when the size is a compile-time
+// constant (typically sizeof a small struct), are done inline as 32-bit
+// loads and stores instead of calling memcpy.
+typedef uint32_t __attribute__((__may_alias__, __aligned__(1))) memcpy_word_t;
+
+static inline void *
+memcpy_const(void *dst, const void *src, size_t len)
+{
+	memcpy_word_t *d = (memcpy_word_t *) dst;
+	const memcpy_word_t *s = (const memcpy_word_t *) src;
+
+	switch (len) {
+	case 32:
+		d[7] = s[7];
+		d[6] = s[6];
+		d[5] = s[5];
+		d[4] = s[4];
+		/* fall through */
+	case 16:
+		d[3] = s[3];
+		d[2] = s[2];
+		/* fall through */
+	case 8:
+		d[1] = s[1];
+		/* fall through */
+	case 4:
+		d[0] = s[0];
+	}
+	return dst;
+}
+
+#define memcpy(dst, src, len)						\
+	(__builtin_constant_p(len) &&					\
+	 ((len) == 4 || (len) == 8 || (len) == 16 || (len) == 32) ?	\
+	 memcpy_const((dst), (src), (len)) : memcpy((dst), (src), (len)))
+
 #endif /* not JOS_INC_STRING_H */
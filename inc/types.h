@@ -23,8 +23,14 @@ typedef unsigned long long uint64_t;
 // We use pointer types to represent virtual addresses,
 // uintptr_t to represent the numerical values of virtual addresses,
 // and physaddr_t to represent physical addresses.
+#ifdef __x86_64__
+// (Except in host-native builds of lib/ code; see native/Makefrag.)
+typedef long intptr_t;
+typedef unsigned long uintptr_t;
+#else
 typedef int32_t intptr_t;
 typedef uint32_t uintptr_t;
+#endif
 typedef uint32_t physaddr_t;
 
 // Page numbers are 32 bits long.
@@ -3,6 +3,27 @@
 
 #include <inc/types.h>
 
+// Feature flags returned in %edx by cpuid(1, ...)
+#define CPUID_EDX_PSE	0x00000008	// 4MB pages
+#define CPUID_EDX_APIC	0x00000200	// Local APIC
+#define CPUID_EDX_SEP	0x00000800	// sysenter/sysexit
+#define CPUID_EDX_PGE	0x00002000	// Global pages
+#define CPUID_EDX_PAT	0x00010000	// Page Attribute Table
+#define CPUID_EDX_FXSR	0x01000000	// FXSAVE/FXRSTOR
+#define CPUID_EDX_SSE	0x02000000	// SSE
+#define CPUID_EDX_SSE2	0x04000000	// SSE2
+
+// Feature flags returned in %ecx by cpuid(1, ...)
+#define CPUID_ECX_TSC_DEADLINE	0x01000000	// LAPIC TSC-deadline timer
+
+// Model-specific registers
+#define MSR_IA32_APIC_BASE	0x01b	// Local APIC base address
+#define MSR_IA32_SYSENTER_CS	0x174	// sysenter code segment
+#define MSR_IA32_SYSENTER_ESP	0x175	// sysenter stack pointer
+#define MSR_IA32_SYSENTER_EIP	0x176	// sysenter entry point
+#define MSR_IA32_PAT		0x277	// Page Attribute Table
+#define MSR_IA32_TSC_DEADLINE	0x6e0	// LAPIC timer deadline
+
 static inline void
 breakpoint(void)
 {
@@ -111,6 +132,12 @@ invlpg(void *addr)
 	asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
 }
 
+static inline void
+wbinvd(void)
+{
+	asm volatile("wbinvd" : : : "memory");
+}
+
 static inline void
 lidt(void *p)
 {
@@ -240,6 +267,15 @@ cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *e
 		*edxp = edx;
 }
 
+// Index of the lowest set bit in 'v', which must not be 0.
+static inline uint32_t
+bsf(uint32_t v)
+{
+	uint32_t r;
+	asm("bsfl %1,%0" : "=r" (r) : "rm" (v) : "cc");
+	return r;
+}
+
 static inline uint64_t
 read_tsc(void)
 {
@@ -248,6 +284,20 @@ read_tsc(void)
 	return tsc;
 }
 
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -261,4 +311,30 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically set *addr to newval if it holds oldval.  Returns what
+// *addr held, which is oldval if the swap happened.  Like any locked
+// instruction it is a full barrier, so the compiler must not move other
+// memory accesses across it either.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (oldval)
+		     : "cc", "memory");
+	return result;
+}
+
+// Atomically add inc to *addr.  Returns what *addr held before.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t inc)
+{
+	asm volatile("lock; xaddl %0, %1"
+		     : "+r" (inc), "+m" (*addr)
+		     : : "cc");
+	return inc;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -0,0 +1,248 @@
+// In-kernel microbenchmarks.
+//
+// Each entry in benchmarks[] names one operation to time.  bench_run()
+// runs it BENCH_WARMUP times untimed and then BENCH_RUNS times under
+// read_tsc(), and prints one line per size of the form
+//
+//	bench <name> size=<bytes> min=<cycles> median=<cycles> cpb=<x.yy>
+//
+// so that scripts (see grade-perf) can parse the results.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+
+#include <kern/bench.h>
+#include <kern/bulk.h>
+#include <kern/kdebug.h>
+
+static uint8_t bench_src[BENCH_MAXSIZE] __attribute__((aligned(PGSIZE)));
+static uint8_t bench_dst[BENCH_MAXSIZE] __attribute__((aligned(PGSIZE)));
+
+static const size_t bench_default_sizes[] = {
+	16, 64, 256, 1024, 4096, 16384, 65536
+};
+
+
+/***** Benchmarked operations *****/
+
+static void
+setup_bytes(size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < BENCH_MAXSIZE; i++)
+		bench_src[i] = bench_dst[i] = i * 7;
+}
+
+// Fill bench_src with a string of length size-1.
+static void
+setup_string(size_t size)
+{
+	memset(bench_src, 'a', BENCH_MAXSIZE);
+	bench_src[size > 0 ? size - 1 : 0] = '\0';
+}
+
+static void
+bench_memset(size_t size)
+{
+	memset(bench_dst, 0x5a, size);
+}
+
+static void
+bench_memcpy(size_t size)
+{
+	memcpy(bench_dst, bench_src, size);
+}
+
+static void
+bench_memmove(size_t size)
+{
+	memmove(bench_dst, bench_src, size);
+}
+
+// Overlapping move to a higher address, which must copy backwards.
+static void
+bench_memmove_back(size_t size)
+{
+	if (size > 0)
+		memmove(bench_src + 1, bench_src, size - 1);
+}
+
+static void
+bench_bulk_zero(size_t size)
+{
+	bulk_zero(bench_dst, size);
+}
+
+static void
+bench_bulk_copy(size_t size)
+{
+	bulk_copy(bench_dst, bench_src, size);
+}
+
+static void
+bench_memcmp(size_t size)
+{
+	memcmp(bench_dst, bench_src, size);
+}
+
+static void
+bench_strlen(size_t size)
+{
+	strlen((char *) bench_src);
+}
+
+// Searches for a byte that setup_string() never stores.
+static void
+bench_strchr(size_t size)
+{
+	strchr((char *) bench_src, 'b');
+}
+
+static void
+bench_memfind(size_t size)
+{
+	memfind(bench_src, 'b', size);
+}
+
+static void
+bench_vsnprintf(size_t size)
+{
+	snprintf((char *) bench_dst, size, "%d %08x %s",
+		 6828, 0xf0100000, (char *) bench_src);
+}
+
+static void
+bench_debuginfo_eip(size_t size)
+{
+	struct Eipdebuginfo info;
+
+	debuginfo_eip((uintptr_t) debuginfo_eip + 16, &info);
+}
+
+static struct Benchmark benchmarks[] = {
+	{ "memset", "memset() of size bytes",
+	  setup_bytes, bench_memset, 1 },
+	{ "memcpy", "memcpy() of size bytes",
+	  setup_bytes, bench_memcpy, 1 },
+	{ "memmove", "Non-overlapping memmove() of size bytes",
+	  setup_bytes, bench_memmove, 1 },
+	{ "memmove-back", "Overlapping backward memmove() of size bytes",
+	  setup_bytes, bench_memmove_back, 1 },
+	{ "bulk_zero", "bulk_zero() of size bytes",
+	  setup_bytes, bench_bulk_zero, 1 },
+	{ "bulk_copy", "bulk_copy() of size bytes",
+	  setup_bytes, bench_bulk_copy, 1 },
+	{ "memcmp", "memcmp() of two equal size-byte buffers",
+	  setup_bytes, bench_memcmp, 1 },
+	{ "strlen", "strlen() of a size-byte string",
+	  setup_string, bench_strlen, 1 },
+	{ "strchr", "strchr() for a byte absent from a size-byte string",
+	  setup_string, bench_strchr, 1 },
+	{ "memfind", "memfind() for a byte absent from size bytes",
+	  setup_string, bench_memfind, 1 },
+	{ "vsnprintf", "snprintf() of a %s conversion into size bytes",
+	  setup_string, bench_vsnprintf, 1 },
+	{ "debuginfo_eip", "debuginfo_eip() of a kernel address",
+	  NULL, bench_debuginfo_eip, 0 },
+};
+
+
+/***** Benchmark runner *****/
+
+// Cycles taken by a timed run of an empty operation.
+static uint64_t
+bench_overhead(void)
+{
+	uint64_t t0, t1, min = ~0ULL;
+	int i;
+
+	for (i = 0; i < BENCH_RUNS; i++) {
+		t0 = read_tsc();
+		t1 = read_tsc();
+		if (t1 - t0 < min)
+			min = t1 - t0;
+	}
+	return min;
+}
+
+static void
+bench_one(struct Benchmark *b, size_t size, uint64_t overhead)
+{
+	uint64_t samples[BENCH_RUNS], t0, t1, tmp;
+	uint32_t cpb;
+	int i, j;
+
+	if (b->setup)
+		b->setup(size);
+	for (i = 0; i < BENCH_WARMUP; i++)
+		b->func(size);
+	for (i = 0; i < BENCH_RUNS; i++) {
+		t0 = read_tsc();
+		b->func(size);
+		t1 = read_tsc();
+		samples[i] = t1 - t0 > overhead ? t1 - t0 - overhead : 0;
+	}
+
+	// Insertion sort; the samples are few.
+	for (i = 1; i < BENCH_RUNS; i++)
+		for (j = i; j > 0 && samples[j] < samples[j - 1]; j--) {
+			tmp = samples[j];
+			samples[j] = samples[j - 1];
+			samples[j - 1] = tmp;
+		}
+
+	cprintf("bench %s size=%u min=%llu median=%llu ", b->name,
+		size, samples[0], samples[BENCH_RUNS / 2]);
+	if (b->sized && size > 0) {
+		cpb = samples[BENCH_RUNS / 2] * 100 / size;
+		cprintf("cpb=%u.%02u\n", cpb / 100, cpb % 100);
+	} else
+		cprintf("cpb=-\n");
+}
+
+void
+bench_list(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(benchmarks); i++)
+		cprintf("%s - %s\n", benchmarks[i].name, benchmarks[i].desc);
+}
+
+// Run the benchmark called 'name' (or every benchmark, if 'name' is
+// "all") at each of the given sizes, or at a default set of sizes if
+// nsizes is 0.  Returns -1 if there is no such benchmark.
+int
+bench_run(const char *name, const size_t *sizes, int nsizes)
+{
+	struct Benchmark *b;
+	uint64_t overhead;
+	bool all = strcmp(name, "all") == 0, found = 0;
+	int i;
+
+	if (nsizes == 0) {
+		sizes = bench_default_sizes;
+		nsizes = ARRAY_SIZE(bench_default_sizes);
+	}
+	overhead = bench_overhead();
+
+	for (b = benchmarks; b < benchmarks + ARRAY_SIZE(benchmarks); b++) {
+		if (!all && strcmp(name, b->name) != 0)
+			continue;
+		found = 1;
+		if (!b->sized) {
+			bench_one(b, 0, overhead);
+			continue;
+		}
+		for (i = 0; i < nsizes; i++)
+			if (sizes[i] <= BENCH_MAXSIZE)
+				bench_one(b, sizes[i], overhead);
+			else
+				cprintf("bench %s size=%u: larger than %u\n",
+					b->name, sizes[i], BENCH_MAXSIZE);
+	}
+	return found ? 0 : -1;
+}
@@ -0,0 +1,29 @@
+#ifndef JOS_KERN_BENCH_H
+#define JOS_KERN_BENCH_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+#define BENCH_MAXSIZE	65536	// largest buffer a benchmark may touch
+#define BENCH_MAXSIZES	16	// most sizes one 'bench' command may list
+#define BENCH_WARMUP	3	// untimed runs before measuring
+#define BENCH_RUNS	15	// timed runs per size
+
+struct Benchmark {
+	const char *name;
+	const char *desc;
+	// Prepare the buffers for a run over 'size' bytes (may be NULL).
+	void (*setup)(size_t size);
+	// Run the benchmarked operation once over 'size' bytes.
+	void (*func)(size_t size);
+	// Whether 'size' means anything to func; if not, the benchmark
+	// is run once and no cycles-per-byte figure is reported.
+	bool sized;
+};
+
+void bench_list(void);
+int bench_run(const char *name, const size_t *sizes, int nsizes);
+
+#endif	// !JOS_KERN_BENCH_H
@@ -0,0 +1,344 @@
+// Zeroing and copying of page-sized and larger buffers.
+//
+// bulk_init() uses CPUID to pick the best of the implementations in
+// bulk_impls[].  With SSE2 that is a loop of 16-byte movntdq stores,
+// which bypass the cache: a page being zeroed or copied is usually not
+// read again soon, so there's no point evicting useful lines for it.
+//
+// bulk_calibrate() then times each of lib/string.c's strategies for
+// memcpy and memset, including handing large buffers to the routines
+// here, and records the fastest for each size class in string_tunables.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+
+#include <kern/bulk.h>
+#include <kern/fpu.h>
+
+static void
+rep_zero(void *dst, size_t len)
+{
+	memset(dst, 0, len);
+}
+
+static void
+rep_copy(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+
+/***** SSE2 *****/
+
+// The kernel is compiled without -msse, so gcc never keeps anything in
+// the xmm registers and they need no asm clobbers.  A task's registers
+// may be live in them, though: bulk_zero() and bulk_copy() bracket these
+// routines with kernel_fpu_begin() and kernel_fpu_end(), which save
+// them first.
+
+// Zero n bytes at d, which must be 16-byte aligned; n must be a
+// multiple of 64.  With 'nt', store around the cache.
+static void
+sse2_zero_body(uint8_t *d, size_t n, bool nt)
+{
+	uint8_t *end = d + n;
+
+	asm volatile("pxor %%xmm0, %%xmm0" : :);
+	if (nt) {
+		for (; d < end; d += 64)
+			asm volatile("movntdq %%xmm0, 0(%0)\n\t"
+				     "movntdq %%xmm0, 16(%0)\n\t"
+				     "movntdq %%xmm0, 32(%0)\n\t"
+				     "movntdq %%xmm0, 48(%0)\n"
+				     : : "r" (d) : "memory");
+		// Non-temporal stores are weakly ordered.
+		asm volatile("sfence" : : : "memory");
+	} else
+		for (; d < end; d += 64)
+			asm volatile("movdqa %%xmm0, 0(%0)\n\t"
+				     "movdqa %%xmm0, 16(%0)\n\t"
+				     "movdqa %%xmm0, 32(%0)\n\t"
+				     "movdqa %%xmm0, 48(%0)\n"
+				     : : "r" (d) : "memory");
+}
+
+// Copy n bytes from s to d, as sse2_zero_body().  s need not be aligned.
+static void
+sse2_copy_body(uint8_t *d, const uint8_t *s, size_t n, bool nt)
+{
+	uint8_t *end = d + n;
+
+	for (; d < end; d += 64, s += 64) {
+		asm volatile("movdqu 0(%0), %%xmm0\n\t"
+			     "movdqu 16(%0), %%xmm1\n\t"
+			     "movdqu 32(%0), %%xmm2\n\t"
+			     "movdqu 48(%0), %%xmm3\n"
+			     : : "r" (s) : "memory");
+		if (nt)
+			asm volatile("movntdq %%xmm0, 0(%0)\n\t"
+				     "movntdq %%xmm1, 16(%0)\n\t"
+				     "movntdq %%xmm2, 32(%0)\n\t"
+				     "movntdq %%xmm3, 48(%0)\n"
+				     : : "r" (d) : "memory");
+		else
+			asm volatile("movdqa %%xmm0, 0(%0)\n\t"
+				     "movdqa %%xmm1, 16(%0)\n\t"
+				     "movdqa %%xmm2, 32(%0)\n\t"
+				     "movdqa %%xmm3, 48(%0)\n"
+				     : : "r" (d) : "memory");
+	}
+	if (nt)
+		asm volatile("sfence" : : : "memory");
+}
+
+// Align the destination with memset, zero the 64-byte blocks that follow
+// with SSE2, and memset whatever is left.
+static void
+sse2_zero_common(void *dst, size_t len, bool nt)
+{
+	uint8_t *d = dst;
+	size_t n;
+
+	if (len < BULK_MIN) {
+		memset(dst, 0, len);
+		return;
+	}
+	n = -(uintptr_t) d & 15;
+	memset(d, 0, n);
+	d += n;
+	len -= n;
+
+	n = ROUNDDOWN(len, 64);
+	sse2_zero_body(d, n, nt);
+	memset(d + n, 0, len - n);
+}
+
+static void
+sse2_copy_common(void *dst, const void *src, size_t len, bool nt)
+{
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t n;
+
+	if (len < BULK_MIN) {
+		memcpy(dst, src, len);
+		return;
+	}
+	n = -(uintptr_t) d & 15;
+	memcpy(d, s, n);
+	d += n;
+	s += n;
+	len -= n;
+
+	n = ROUNDDOWN(len, 64);
+	sse2_copy_body(d, s, n, nt);
+	memcpy(d + n, s + n, len - n);
+}
+
+static void
+sse2_zero(void *dst, size_t len)
+{
+	sse2_zero_common(dst, len, 0);
+}
+
+static void
+sse2_copy(void *dst, const void *src, size_t len)
+{
+	sse2_copy_common(dst, src, len, 0);
+}
+
+static void
+sse2_nt_zero(void *dst, size_t len)
+{
+	sse2_zero_common(dst, len, 1);
+}
+
+static void
+sse2_nt_copy(void *dst, const void *src, size_t len)
+{
+	sse2_copy_common(dst, src, len, 1);
+}
+
+
+/***** Dispatch *****/
+
+// From worst to best; bulk_init() picks the last one the CPU supports.
+static const struct Bulk_impl bulk_impls[] = {
+	{ "rep", 0, rep_zero, rep_copy },
+	{ "sse2", CPUID_EDX_FXSR | CPUID_EDX_SSE2, sse2_zero, sse2_copy },
+	{ "sse2-nt", CPUID_EDX_FXSR | CPUID_EDX_SSE2,
+	  sse2_nt_zero, sse2_nt_copy },
+};
+
+// i386_init() calls bulk_init() and then bulk_zero() to clear the BSS,
+// so this must be initialized data.
+static const struct Bulk_impl *bulk_impl = &bulk_impls[0];
+
+void
+bulk_init(void)
+{
+	uint32_t edx;
+	int i;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	for (i = ARRAY_SIZE(bulk_impls) - 1; i > 0; i--)
+		if ((edx & bulk_impls[i].bi_cpuid_edx)
+		    == bulk_impls[i].bi_cpuid_edx)
+			break;
+	bulk_impl = &bulk_impls[i];
+
+	if (bulk_impl->bi_cpuid_edx & CPUID_EDX_SSE2) {
+		bulk_init_percpu();
+
+		// Offer the SSE2 routines to memcpy and memset.  The
+		// rep implementation just calls them, so isn't offered.
+		string_tunables.st_bulk_copy = bulk_copy;
+		string_tunables.st_bulk_zero = bulk_zero;
+	}
+}
+
+// Let this CPU run the SSE instructions bulk_init() chose.  The APs
+// call this themselves once they are up.
+void
+bulk_init_percpu(void)
+{
+	if (!(bulk_impl->bi_cpuid_edx & CPUID_EDX_SSE2))
+		return;
+	// Run SSE instructions natively rather than trapping, and let
+	// them use FXSAVE state and report SIMD exceptions as #XM.
+	lcr0((rcr0() & ~CR0_EM) | CR0_MP);
+	lcr4(rcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+}
+
+const char *
+bulk_name(void)
+{
+	return bulk_impl->bi_name;
+}
+
+// The SSE2 routines use the XMM registers, which may hold a task's
+// state: see kern/fpu.c.
+void
+bulk_zero(void *dst, size_t len)
+{
+	if (!bulk_impl->bi_cpuid_edx) {
+		bulk_impl->bi_zero(dst, len);
+		return;
+	}
+	kernel_fpu_begin();
+	bulk_impl->bi_zero(dst, len);
+	kernel_fpu_end();
+}
+
+void
+bulk_copy(void *dst, const void *src, size_t len)
+{
+	if (!bulk_impl->bi_cpuid_edx) {
+		bulk_impl->bi_copy(dst, src, len);
+		return;
+	}
+	kernel_fpu_begin();
+	bulk_impl->bi_copy(dst, src, len);
+	kernel_fpu_end();
+}
+
+
+/***** Calibration of lib/string.c *****/
+
+#define CAL_RUNS	8	// timed runs per strategy; the fastest counts
+
+// A size from each of the STR_NCLASS classes to time.
+static const size_t cal_sizes[STR_NCLASS] = { 64, 1024, 16384 };
+
+static uint8_t cal_src[16384 + 16] __attribute__((aligned(PGSIZE)));
+static uint8_t cal_dst[16384 + 16] __attribute__((aligned(PGSIZE)));
+
+static const char *const str_strategy_names[] = {
+	[STR_BYTES] = "bytes",
+	[STR_WORDS] = "words",
+	[STR_BULK] = "bulk",
+};
+
+// Cycles to memcpy or memset 'size' bytes using the current tunables,
+// summed over an aligned destination and one a byte off, since the
+// strategies differ most in how they cope with misalignment.
+static uint64_t
+cal_time(bool set, size_t size)
+{
+	uint64_t t, best, total = 0;
+	int off, i;
+
+	for (off = 0; off < 2; off++) {
+		best = ~0ULL;
+		for (i = 0; i < CAL_RUNS; i++) {
+			t = read_tsc();
+			if (set)
+				memset(cal_dst + off, 0, size);
+			else
+				memcpy(cal_dst + off, cal_src, size);
+			t = read_tsc() - t;
+			if (t < best)
+				best = t;
+		}
+		total += best;
+	}
+	return total;
+}
+
+// Fill in table[] (string_tunables.st_copy or st_set) with the fastest
+// strategy for each size class.
+static void
+cal_pick(uint8_t *table, bool set)
+{
+	uint64_t t, best;
+	int c, how, best_how;
+	bool have_bulk;
+
+	// memset's bulk path is bulk_zero, memcpy's is bulk_copy.
+	have_bulk = set ? string_tunables.st_bulk_zero != NULL
+		: string_tunables.st_bulk_copy != NULL;
+	for (c = 0; c < STR_NCLASS; c++) {
+		best = ~0ULL;
+		best_how = table[c];
+		for (how = STR_BYTES; how <= STR_BULK; how++) {
+			// The bulk routines use memcpy and memset
+			// below STR_LARGE, so must not be used there.
+			if (how == STR_BULK && (!have_bulk
+						|| cal_sizes[c] < STR_LARGE))
+				continue;
+			table[c] = how;
+			t = cal_time(set, cal_sizes[c]);
+			if (t < best) {
+				best = t;
+				best_how = how;
+			}
+		}
+		table[c] = best_how;
+	}
+}
+
+void
+bulk_calibrate(void)
+{
+	cal_pick(string_tunables.st_copy, 0);
+	cal_pick(string_tunables.st_set, 1);
+}
+
+void
+bulk_print_tunables(void)
+{
+	static const char *const class_names[STR_NCLASS] = {
+		"16-255", "256-4095", "4096-"
+	};
+	int c;
+
+	cprintf("  bulk implementation: %s\n", bulk_name());
+	cprintf("  %-10s %-8s %-8s\n", "size", "memcpy", "memset");
+	for (c = 0; c < STR_NCLASS; c++)
+		cprintf("  %-10s %-8s %-8s\n", class_names[c],
+			str_strategy_names[string_tunables.st_copy[c]],
+			str_strategy_names[string_tunables.st_set[c]]);
+}
@@ -0,0 +1,31 @@
+#ifndef JOS_KERN_BULK_H
+#define JOS_KERN_BULK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Buffers shorter than this are left to memset() and memcpy().
+#define BULK_MIN	4096
+
+// One way of zeroing and copying large buffers.
+struct Bulk_impl {
+	const char *bi_name;
+	uint32_t bi_cpuid_edx;	// CPUID.1:EDX features it needs
+	void (*bi_zero)(void *dst, size_t len);
+	// Copies between buffers that must not overlap.
+	void (*bi_copy)(void *dst, const void *src, size_t len);
+};
+
+void bulk_init(void);
+void bulk_init_percpu(void);
+void bulk_calibrate(void);
+const char *bulk_name(void);
+void bulk_print_tunables(void);
+
+// Zero or copy 'len' bytes using the implementation bulk_init() chose.
+void bulk_zero(void *dst, size_t len);
+void bulk_copy(void *dst, const void *src, size_t len);
+
+#endif	// !JOS_KERN_BULK_H
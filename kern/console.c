@@ -5,8 +5,12 @@
 #include <inc/kbdreg.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/trap.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+#include <kern/timer.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -100,6 +104,9 @@ serial_init(void)
 	(void) inb(COM1+COM_IIR);
 	(void) inb(COM1+COM_RX);
 
+	// Enable serial interrupts, so an idle CPU wakes for input
+	if (serial_exists)
+		irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_SERIAL));
 }
 
 
@@ -129,6 +136,12 @@ static unsigned addr_6845;
 static uint16_t *crt_buf;
 static uint16_t crt_pos;
 
+// A copy of the screen in ordinary memory.  Scrolling works on the copy
+// and then writes the whole screen out, so the display memory is only
+// ever written, in order, which a write-combining mapping turns into
+// bursts.
+static uint16_t crt_shadow[CRT_SIZE];
+
 static void
 cga_init(void)
 {
@@ -155,8 +168,16 @@ cga_init(void)
 
 	crt_buf = (uint16_t*) cp;
 	crt_pos = pos;
+	memcpy(crt_shadow, crt_buf, sizeof(crt_shadow));
 }
 
+// Once there are page tables to do it with, make the display memory
+// write-combining, where it is in the window at KERNBASE.
+void
+cga_map_wc(void)
+{
+	direct_map_wc(PADDR(crt_buf), sizeof(crt_shadow));
+}
 
 
 static void
@@ -170,7 +191,7 @@ cga_putc(int c)
 	case '\b':
 		if (crt_pos > 0) {
 			crt_pos--;
-			crt_buf[crt_pos] = (c & ~0xff) | ' ';
+			crt_buf[crt_pos] = crt_shadow[crt_pos] = (c & ~0xff) | ' ';
 		}
 		break;
 	case '\n':
@@ -187,7 +208,8 @@ cga_putc(int c)
 		cons_putc(' ');
 		break;
 	default:
-		crt_buf[crt_pos++] = c;		/* write the character */
+		crt_buf[crt_pos] = crt_shadow[crt_pos] = c; /* write the character */
+		crt_pos++;
 		break;
 	}
 
@@ -195,9 +217,10 @@ cga_putc(int c)
 	if (crt_pos >= CRT_SIZE) {
 		int i;
 
-		memmove(crt_buf, crt_buf + CRT_COLS, (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
+		memmove(crt_shadow, crt_shadow + CRT_COLS, (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
 		for (i = CRT_SIZE - CRT_COLS; i < CRT_SIZE; i++)
-			crt_buf[i] = 0x0700 | ' ';
+			crt_shadow[i] = 0x0700 | ' ';
+		memcpy(crt_buf, crt_shadow, sizeof(crt_shadow));
 		crt_pos -= CRT_COLS;
 	}
 
@@ -373,6 +396,9 @@ kbd_intr(void)
 static void
 kbd_init(void)
 {
+	// Drain the kbd buffer so that QEMU generates interrupts.
+	kbd_intr();
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_KBD));
 }
 
 
@@ -464,7 +490,7 @@ getchar(void)
 	int c;
 
 	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+		cpu_idle();
 	return c;
 }
 
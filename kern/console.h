@@ -18,6 +18,7 @@
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
 
 void cons_init(void);
+void cga_map_wc(void);
 int cons_getc(void);
 
 void kbd_intr(void); // irq 1
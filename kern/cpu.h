@@ -0,0 +1,85 @@
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+
+// Maximum number of CPUs
+#define NCPU  8
+
+// Values of status in struct CpuInfo
+enum {
+	CPU_UNUSED = 0,
+	CPU_STARTED,
+	CPU_HALTED,
+};
+
+struct Task;
+struct Fpu_state;
+
+// Per-CPU state
+struct CpuInfo {
+	struct CpuInfo *cpu_self;       // This struct, for thiscpu
+	uint8_t cpu_id;                 // Index into cpus[] below
+	uint8_t cpu_apicid;             // Local APIC ID
+	volatile unsigned cpu_status;   // The status of the CPU
+	struct Task *cpu_task;          // The task running, if any
+	uint32_t *cpu_sched_esp;        // Saved stack of the scheduler loop
+	struct Fpu_state *cpu_fpu_owner; // Whose registers the FPU holds
+	int cpu_ftrace_depth;           // Traced call depth (kern/ftrace.c)
+	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+};
+
+// Initialized in mpconfig.c
+extern struct CpuInfo cpus[NCPU];
+extern int ncpu;                    // Total number of CPUs in the system
+extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
+extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+
+// Per-CPU kernel stacks, mapped below KSTACKTOP by mem_init()
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+
+// The local APIC, mapped by lapic_init()
+extern volatile uint32_t *lapic;
+
+// Read or write a field of this CPU's struct CpuInfo, which %fs maps
+// (see gdt_init_percpu()): a single instruction, with no need to find
+// out which CPU this is.  Only for fields of 1, 2 or 4 bytes.
+#define this_cpu_read(field)						\
+({									\
+	typeof(((struct CpuInfo *) 0)->field) __v;			\
+	asm volatile("mov %%fs:%c1, %0"					\
+		     : "=q" (__v)					\
+		     : "i" (offsetof(struct CpuInfo, field)));		\
+	__v;								\
+})
+
+#define this_cpu_write(field, v)					\
+	asm volatile("mov %1, %%fs:%c0"					\
+		     : : "i" (offsetof(struct CpuInfo, field)),		\
+		       "q" ((typeof(((struct CpuInfo *) 0)->field)) (v))	\
+		     : "memory")
+
+// The index in cpus[] of the CPU we are running on.
+static inline int
+cpunum(void)
+{
+	return this_cpu_read(cpu_id);
+}
+
+#define thiscpu (this_cpu_read(cpu_self))
+
+int lapic_cpunum(void);
+
+void mp_init(void);
+void lapic_init(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_ipi(uint8_t apicid, int vector);
+void lapic_eoi(void);
+void lapic_timer_arm(uint64_t deadline);
+
+#endif	// !JOS_KERN_CPU_H
@@ -0,0 +1,274 @@
+// Lazy switching of the x87 and SSE registers between tasks.
+//
+// Most tasks never touch the FPU, so the scheduler does not save and
+// load its registers on every switch.  Instead CR0.TS is set while a
+// task runs, and the first FPU instruction it executes traps with #NM.
+// fpu_trap() then clears TS and loads the task's registers, unless
+// they are still in the CPU from the last time it used them here: each
+// CPU remembers whose they are in cpu_fpu_owner.  When a task that used
+// the FPU gives up the CPU, fpu_switch_out() saves its registers and
+// sets TS again, since the task may run on another CPU next.  A task
+// that never uses the FPU costs a read of CR0 per switch.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+
+#include <kern/fpu.h>
+#include <kern/cpu.h>
+#include <kern/sched.h>
+#include <kern/pmap.h>
+
+// The registers of a task that has not used the FPU yet.
+static struct Fpu_state fpu_initial;
+static bool fpu_fxsr;			// Use FXSAVE rather than FNSAVE?
+
+// Set by fpu_init().  Until then kernel_fpu_begin() does nothing.
+// bulk_zero() clears the BSS using kernel_fpu_begin(), so this must not
+// live there.
+static bool fpu_ready __attribute__((section(".data")));
+
+// Statistics
+static uint64_t fpu_ntrap;		// #NM traps
+static uint64_t fpu_nrestore;		// ... that had to load registers
+static uint64_t fpu_nsave;		// Registers saved at switch-out
+static uint64_t fpu_nkernel;		// kernel_fpu_begin() calls
+
+static void
+fpu_save(struct Fpu_state *fs)
+{
+	if (fpu_fxsr)
+		asm volatile("fxsave %0" : "=m" (fs->fs_regs));
+	else
+		asm volatile("fnsave %0" : "=m" (fs->fs_regs));
+	fs->fs_saved = 1;
+}
+
+static void
+fpu_restore(struct Fpu_state *fs)
+{
+	if (fpu_fxsr)
+		asm volatile("fxrstor %0" : : "m" (fs->fs_regs));
+	else
+		asm volatile("frstor %0" : : "m" (fs->fs_regs));
+}
+
+static void
+stts(void)
+{
+	lcr0(rcr0() | CR0_TS);
+}
+
+static void
+clts(void)
+{
+	asm volatile("clts");
+}
+
+// Build fpu_initial: the state FNINIT leaves, with every register empty
+// and every exception masked, in whichever format fpu_restore() loads.
+static void
+fpu_initial_init(void)
+{
+	memset(&fpu_initial, 0, sizeof(fpu_initial));
+	*(uint16_t *) &fpu_initial.fs_regs[0] = 0x037F;	// FCW
+	if (fpu_fxsr)
+		*(uint32_t *) &fpu_initial.fs_regs[24] = 0x1F80; // MXCSR
+	else
+		*(uint16_t *) &fpu_initial.fs_regs[8] = 0xFFFF;	// FTW
+}
+
+void
+fpu_init(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	fpu_fxsr = (edx & CPUID_EDX_FXSR) != 0;
+	fpu_initial_init();
+
+	fpu_ready = 1;
+	fpu_init_percpu();
+}
+
+// Make this CPU's first FPU instruction trap.  The APs call this
+// themselves once they are up.
+void
+fpu_init_percpu(void)
+{
+	// MP makes WAIT trap too.
+	lcr0((rcr0() & ~CR0_EM) | CR0_MP | CR0_TS);
+	this_cpu_write(cpu_fpu_owner, NULL);
+}
+
+// Set up fs for a new task.
+void
+fpu_state_init(struct Fpu_state *fs)
+{
+	fs->fs_cpu = -1;
+	fs->fs_saved = 0;
+}
+
+// Handle #NM: give the FPU to whatever is running.
+void
+fpu_trap(void)
+{
+	struct Fpu_state *fs = curtask ? &curtask->t_fpu : NULL;
+
+	clts();
+	fpu_ntrap++;
+	if (!fs) {
+		// Kernel code outside any task, such as user_run(), has no
+		// registers to load, and no task's are live here.
+		this_cpu_write(cpu_fpu_owner, NULL);
+		return;
+	}
+
+	// Are the task's registers still in this CPU, untouched since it
+	// last ran here?
+	if (this_cpu_read(cpu_fpu_owner) == fs && fs->fs_cpu == cpunum())
+		return;
+	fpu_restore(fs->fs_saved ? fs : &fpu_initial);
+	fpu_nrestore++;
+	fs->fs_cpu = cpunum();
+	this_cpu_write(cpu_fpu_owner, fs);
+}
+
+// Called by the scheduler just before it runs a task.  Only code
+// outside any task can have left TS clear.
+void
+fpu_switch_in(void)
+{
+	if (!(rcr0() & CR0_TS))
+		stts();
+}
+
+// Called by the scheduler when the task whose registers are 'fs' has
+// given up the CPU.  If the task used the FPU, TS is clear: save its
+// registers, unless it is 'dead', and make the next task trap.
+void
+fpu_switch_out(struct Fpu_state *fs, bool dead)
+{
+	if (rcr0() & CR0_TS)
+		return;
+	if (dead)
+		this_cpu_write(cpu_fpu_owner, NULL);
+	else {
+		fpu_save(fs);
+		fpu_nsave++;
+		// FNSAVE reinitializes the FPU, so unlike after FXSAVE
+		// the registers are no longer the task's.
+		if (!fpu_fxsr)
+			this_cpu_write(cpu_fpu_owner, NULL);
+	}
+	stts();
+}
+
+// Let the kernel use the FPU registers, saving a task's that are live
+// here.
+void
+kernel_fpu_begin(void)
+{
+	struct Fpu_state *owner;
+
+	if (!fpu_ready)
+		return;
+	if (!(rcr0() & CR0_TS)) {
+		if ((owner = this_cpu_read(cpu_fpu_owner)))
+			fpu_save(owner);
+	} else
+		clts();
+	this_cpu_write(cpu_fpu_owner, NULL);
+	fpu_nkernel++;
+}
+
+// The kernel is done with the FPU.  A task that uses it next traps and
+// loads its own registers.  Outside any task, leave TS clear for the
+// kernel's next use: fpu_switch_in() sets it before any task runs.
+void
+kernel_fpu_end(void)
+{
+	if (fpu_ready && curtask)
+		stts();
+}
+
+void
+fpu_print_stats(void)
+{
+	cprintf("fpu: %llu traps, %llu loads, %llu saves, %llu kernel uses\n",
+		fpu_ntrap, fpu_nrestore, fpu_nsave, fpu_nkernel);
+}
+
+
+static int check_fpu_ndone;
+
+// Keeps a value on the x87 stack across switches to other tasks that
+// do the same, and to the kernel zeroing pages with SSE.  Task n keeps
+// it there for 10*n yields, so the last one runs on its own for a
+// while, and gets back a CPU whose registers it last had.
+static void
+check_fpu_task(void *arg)
+{
+	int32_t v = (int32_t) arg, out;
+	struct PageInfo *pp;
+	int i;
+
+	asm volatile("fildl %0" : : "m" (v));
+	for (i = 0; i < v % 1000 * 10; i++) {
+		sched_yield();
+		if (i % 4 == 0 && (pp = page_alloc(ALLOC_ZERO)))
+			page_free(pp);
+		asm volatile("fistl %0" : "=m" (out));
+		assert(out == v);
+	}
+	asm volatile("fistpl %0" : "=m" (out));
+	check_fpu_ndone++;
+}
+
+// Doesn't touch the FPU, so should never trap.
+static void
+check_nofpu_task(void *arg)
+{
+	int i;
+
+	for (i = 0; i < 20; i++)
+		sched_yield();
+	check_fpu_ndone++;
+}
+
+static void
+check_fpu_tasks(void)
+{
+	uint64_t ntrap = fpu_ntrap;
+	int i;
+
+	check_fpu_ndone = 0;
+	for (i = 1; i <= 3; i++)
+		assert(task_create("check_fpu", 0, check_fpu_task,
+				   (void *) (i * 1000 + i)));
+	assert(task_create("check_nofpu", 0, check_nofpu_task, NULL));
+	sched_run();
+	assert(check_fpu_ndone == 4);
+	assert(fpu_ntrap > ntrap);
+}
+
+void
+check_fpu(void)
+{
+	check_fpu_tasks();
+
+	// Again with FNSAVE and FRSTOR, as on a CPU without FXSR.  No
+	// task's registers are saved or live between the runs, so
+	// nothing is left in the other format.
+	if (fpu_fxsr) {
+		fpu_fxsr = 0;
+		fpu_initial_init();
+		check_fpu_tasks();
+		fpu_fxsr = 1;
+		fpu_initial_init();
+	}
+
+	cprintf("check_fpu() succeeded!\n");
+}
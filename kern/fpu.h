@@ -0,0 +1,30 @@
+#ifndef JOS_KERN_FPU_H
+#define JOS_KERN_FPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// A task's x87/SSE registers, while they are not in a CPU's.
+struct Fpu_state {
+	uint8_t fs_regs[512];		// FXSAVE image, or FNSAVE without FXSR
+	int fs_cpu;			// CPU that last loaded fs_regs, or -1
+	bool fs_saved;			// Does fs_regs hold anything yet?
+} __attribute__((aligned(16)));
+
+void	fpu_init(void);
+void	fpu_init_percpu(void);
+void	fpu_state_init(struct Fpu_state *fs);
+void	fpu_trap(void);
+void	fpu_switch_in(void);
+void	fpu_switch_out(struct Fpu_state *fs, bool dead);
+void	fpu_print_stats(void);
+void	check_fpu(void);
+
+// Bracket kernel code that uses the FPU or SSE registers, which may
+// hold a task's state.
+void	kernel_fpu_begin(void);
+void	kernel_fpu_end(void);
+
+#endif	// !JOS_KERN_FPU_H
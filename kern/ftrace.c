@@ -0,0 +1,293 @@
+// Function entry/exit tracer.
+//
+// Building the kernel with 'make FTRACE=1' compiles every other kernel
+// source file with -finstrument-functions, so gcc brackets each function
+// body with calls to __cyg_profile_func_enter() and
+// __cyg_profile_func_exit().  Those hooks append {TSC, function, depth,
+// CPU} records to a ring buffer that all CPUs share; the 'ftrace' monitor
+// command replays the ring to produce per-function call counts,
+// inclusive/exclusive cycle totals and a time-ordered call graph.
+//
+// This file itself is compiled without instrumentation (see kern/Makefrag),
+// so the hooks never recurse.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/x86.h>
+
+#include <kern/ftrace.h>
+#include <kern/kdebug.h>
+#include <kern/cpu.h>
+
+#define FTRACE_NFUNC	256	// distinct functions tracked by the replay
+#define FTRACE_MAXDEPTH	64	// deepest call stack the replay follows
+
+// The hooks run from the very first instrumented call in i386_init(),
+// before the BSS has been cleared, so the enable flag must live in the
+// data segment to start out reliably zero.
+static volatile bool ftrace_on __attribute__((section(".data")));
+
+// The ring is lock-free: each hook claims a slot by atomically bumping
+// ftrace_head and fills in only that slot, and readers pause tracing
+// while replaying.  Each CPU keeps its own call depth, in its struct
+// CpuInfo.
+static struct Ftrace_rec ftrace_ring[FTRACE_NREC];
+static volatile uint32_t ftrace_head;	// Total records ever logged
+
+// Whether this CPU can use its struct CpuInfo yet.  An AP runs traced
+// code before gdt_init_percpu() points %fs at it.
+static inline bool
+ftrace_cpu_ready(void)
+{
+	uint16_t fs;
+
+	asm volatile("movw %%fs,%0" : "=r" (fs));
+	return fs >= GD_PCPU0;
+}
+
+static void
+ftrace_log(void *fn, int depth, int type)
+{
+	struct Ftrace_rec *r;
+
+	r = &ftrace_ring[xadd(&ftrace_head, 1) & (FTRACE_NREC - 1)];
+	r->fr_tsc = read_tsc();
+	r->fr_fn = (uintptr_t) fn;
+	r->fr_depth = depth;
+	r->fr_type = type;
+	r->fr_cpu = cpunum();
+}
+
+void
+__cyg_profile_func_enter(void *fn, void *call_site)
+{
+	int depth;
+
+	if (!ftrace_on || !ftrace_cpu_ready())
+		return;
+	depth = this_cpu_read(cpu_ftrace_depth);
+	this_cpu_write(cpu_ftrace_depth, depth + 1);
+	ftrace_log(fn, depth, FTRACE_ENTER);
+}
+
+void
+__cyg_profile_func_exit(void *fn, void *call_site)
+{
+	int depth;
+
+	if (!ftrace_on || !ftrace_cpu_ready())
+		return;
+	// Calls that began before tracing was enabled exit at depth 0.
+	if ((depth = this_cpu_read(cpu_ftrace_depth)) > 0)
+		this_cpu_write(cpu_ftrace_depth, --depth);
+	ftrace_log(fn, depth, FTRACE_EXIT);
+}
+
+static void
+ftrace_reset_depth(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		cpus[i].cpu_ftrace_depth = 0;
+}
+
+void
+ftrace_init(void)
+{
+	ftrace_clear();
+#ifdef FTRACE
+	ftrace_on = 1;
+#endif
+}
+
+void
+ftrace_enable(bool on)
+{
+	ftrace_reset_depth();
+	ftrace_on = on;
+}
+
+void
+ftrace_clear(void)
+{
+	ftrace_head = 0;
+	ftrace_reset_depth();
+}
+
+// Index of the oldest record still in the ring.
+static uint32_t
+ftrace_first(void)
+{
+	return ftrace_head > FTRACE_NREC ? ftrace_head - FTRACE_NREC : 0;
+}
+
+static void
+ftrace_print_fn(uintptr_t fn)
+{
+	struct Eipdebuginfo info;
+
+	debuginfo_eip(fn, &info);
+	cprintf("%.*s", info.eip_fn_namelen, info.eip_fn_name);
+}
+
+
+/***** Per-function statistics *****/
+
+struct Ftrace_func {
+	uintptr_t ff_fn;	// Function address (0 = unused slot)
+	uint32_t ff_calls;	// Number of entries seen
+	uint64_t ff_incl;	// Cycles spent in the function and its callees
+	uint64_t ff_excl;	// Cycles spent in the function body alone
+};
+
+static struct Ftrace_func ftrace_funcs[FTRACE_NFUNC];
+
+// Find or create the statistics slot for 'fn' in the open-addressed
+// ftrace_funcs table.  Returns NULL if the table is full.
+static struct Ftrace_func *
+ftrace_func_lookup(uintptr_t fn)
+{
+	uint32_t h, i;
+	struct Ftrace_func *f;
+
+	h = (fn >> 2) * 2654435761U;
+	for (i = 0; i < FTRACE_NFUNC; i++) {
+		f = &ftrace_funcs[(h + i) & (FTRACE_NFUNC - 1)];
+		if (f->ff_fn == fn)
+			return f;
+		if (f->ff_fn == 0) {
+			f->ff_fn = fn;
+			return f;
+		}
+	}
+	return NULL;
+}
+
+// Replay the ring, matching each exit with its entry on a shadow stack,
+// one per CPU.  Records whose entry fell off the end of the ring are
+// ignored, as are calls nested deeper than FTRACE_MAXDEPTH.
+static int
+ftrace_replay(void)
+{
+	static struct {
+		uintptr_t fn;
+		uint64_t start;
+		uint64_t child;
+	} stacks[NCPU][FTRACE_MAXDEPTH], *stack;
+	int sps[NCPU], skips[NCPU], *sp, *skip, n, j;
+	uint32_t i;
+	uint64_t dur;
+	struct Ftrace_rec *r;
+	struct Ftrace_func *f;
+
+	memset(ftrace_funcs, 0, sizeof(ftrace_funcs));
+	memset(sps, 0, sizeof(sps));
+	memset(skips, 0, sizeof(skips));
+	for (i = ftrace_first(); i != ftrace_head; i++) {
+		r = &ftrace_ring[i & (FTRACE_NREC - 1)];
+		if (r->fr_cpu >= NCPU)
+			continue;
+		stack = stacks[r->fr_cpu];
+		sp = &sps[r->fr_cpu];
+		skip = &skips[r->fr_cpu];
+		if (r->fr_type == FTRACE_ENTER) {
+			if ((f = ftrace_func_lookup(r->fr_fn)))
+				f->ff_calls++;
+			if (*sp == FTRACE_MAXDEPTH) {
+				(*skip)++;
+				continue;
+			}
+			stack[*sp].fn = r->fr_fn;
+			stack[*sp].start = r->fr_tsc;
+			stack[*sp].child = 0;
+			(*sp)++;
+			continue;
+		}
+
+		if (*skip > 0) {
+			(*skip)--;
+			continue;
+		}
+		for (j = *sp - 1; j >= 0 && stack[j].fn != r->fr_fn; j--)
+			/* do nothing */;
+		if (j < 0)
+			continue;
+		*sp = j;
+		dur = r->fr_tsc - stack[j].start;
+		if ((f = ftrace_func_lookup(r->fr_fn))) {
+			f->ff_incl += dur;
+			f->ff_excl += dur - stack[j].child;
+		}
+		if (j > 0)
+			stack[j - 1].child += dur;
+	}
+
+	// Compact the used slots to the front of the table.
+	for (i = 0, n = 0; i < FTRACE_NFUNC; i++)
+		if (ftrace_funcs[i].ff_fn)
+			ftrace_funcs[n++] = ftrace_funcs[i];
+	return n;
+}
+
+void
+ftrace_print_stats(void)
+{
+	bool was_on = ftrace_on;
+	struct Ftrace_func tmp;
+	int n, i, j, max;
+
+	ftrace_on = 0;
+	n = ftrace_replay();
+
+	// Selection sort by inclusive time, most expensive first.
+	for (i = 0; i < n; i++) {
+		for (max = i, j = i + 1; j < n; j++)
+			if (ftrace_funcs[j].ff_incl > ftrace_funcs[max].ff_incl)
+				max = j;
+		tmp = ftrace_funcs[i];
+		ftrace_funcs[i] = ftrace_funcs[max];
+		ftrace_funcs[max] = tmp;
+	}
+
+	cprintf("%u records, %u in ring\n", ftrace_head,
+		ftrace_head - ftrace_first());
+	cprintf("     calls   incl-cycles   excl-cycles  function\n");
+	for (i = 0; i < n; i++) {
+		cprintf("%10u %13llu %13llu  ", ftrace_funcs[i].ff_calls,
+			ftrace_funcs[i].ff_incl, ftrace_funcs[i].ff_excl);
+		ftrace_print_fn(ftrace_funcs[i].ff_fn);
+		cprintf("\n");
+	}
+	ftrace_on = was_on;
+}
+
+void
+ftrace_print_graph(int nrec)
+{
+	bool was_on = ftrace_on;
+	uint32_t i, start;
+	uint64_t base;
+	struct Ftrace_rec *r;
+
+	ftrace_on = 0;
+	start = ftrace_first();
+	if (nrec > 0 && ftrace_head - start > nrec)
+		start = ftrace_head - nrec;
+	base = ftrace_ring[start & (FTRACE_NREC - 1)].fr_tsc;
+
+	for (i = start; i != ftrace_head; i++) {
+		r = &ftrace_ring[i & (FTRACE_NREC - 1)];
+		cprintf("%12llu %2d  %*s", r->fr_tsc - base, r->fr_cpu,
+			2 * r->fr_depth, "");
+		if (r->fr_type == FTRACE_ENTER) {
+			ftrace_print_fn(r->fr_fn);
+			cprintf("() {\n");
+		} else {
+			cprintf("} // ");
+			ftrace_print_fn(r->fr_fn);
+			cprintf("\n");
+		}
+	}
+	ftrace_on = was_on;
+}
@@ -0,0 +1,31 @@
+#ifndef JOS_KERN_FTRACE_H
+#define JOS_KERN_FTRACE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Number of records kept in the trace ring (must be a power of 2).
+#define FTRACE_NREC	8192
+
+// Record types
+#define FTRACE_ENTER	0
+#define FTRACE_EXIT	1
+
+// One function entry or exit, as logged by the instrumentation hooks.
+struct Ftrace_rec {
+	uint64_t fr_tsc;	// Time stamp counter at entry/exit
+	uintptr_t fr_fn;	// Address of the instrumented function
+	uint16_t fr_depth;	// Call depth (0 = outermost traced call)
+	uint8_t fr_type;	// FTRACE_ENTER or FTRACE_EXIT
+	uint8_t fr_cpu;		// CPU that made the call
+};
+
+void ftrace_init(void);
+void ftrace_enable(bool on);
+void ftrace_clear(void);
+void ftrace_print_stats(void);
+void ftrace_print_graph(int nrec);
+
+#endif	// !JOS_KERN_FTRACE_H
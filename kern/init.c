@@ -6,6 +6,20 @@
 
 #include <kern/monitor.h>
 #include <kern/console.h>
+#include <kern/ftrace.h>
+#include <kern/bulk.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/trap.h>
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+#include <kern/timer.h>
+#include <kern/spinlock.h>
+#include <kern/sched.h>
+#include <kern/fpu.h>
+
+static void boot_aps(void);
 
 // Test the stack backtrace function (lab 1 only)
 void
@@ -27,12 +41,62 @@ i386_init(void)
 	// Before doing anything else, complete the ELF loading process.
 	// Clear the uninitialized global data (BSS) section of our program.
 	// This ensures that all static/global variables start out zero.
-	memset(edata, 0, end - edata);
+	// bulk_init() keeps its choice of implementation in the data
+	// segment, so it can pick the zeroing loop first.
+	bulk_init();
+	bulk_zero(edata, end - edata);
+
+	// The BSP is cpus[0].  Load the GDT so that cpunum() and thiscpu
+	// work.
+	gdt_init_percpu(0);
 
 	// Initialize the console.
 	// Can't call cprintf until after we do this!
 	cons_init();
 
+	// Calibrate the TSC, the kernel's clock, and read the wall clock.
+	time_init();
+
+	// Start the function tracer (a no-op unless built with FTRACE=1).
+	ftrace_init();
+
+	// Lab 2 memory management initialization functions
+	mem_init();
+	kmem_init();
+
+	// Now that there are page tables for it, map the display
+	// write-combining.
+	cga_map_wc();
+
+	// Load the GDT, TSS and IDT, and set up sysenter.
+	trap_init();
+
+	// From now on, give tasks the FPU only when they use it.
+	fpu_init();
+
+	// Pick the fastest way for memcpy and memset to handle each size
+	// of buffer on this CPU.  The bulk routines now pay for
+	// kernel_fpu_begin() and kernel_fpu_end(), so time them that way.
+	bulk_calibrate();
+
+	// Find the other CPUs.  Set up the interrupt controllers, and
+	// from then on, halt when idle and run timers off the one-shot
+	// LAPIC timer.
+	mp_init();
+	lapic_init();
+	pic_init();
+	timer_init();
+
+	check_locks();
+
+	// Acquire the big kernel lock before waking up APs.
+	lock_kernel();
+
+	// Starting non-boot CPUs
+	boot_aps();
+
+	check_fpu();
+
 	cprintf("6828 decimal is %o octal!\n", 6828);
 
 	// Test the stack backtrace function (lab 1 only)
@@ -43,6 +107,71 @@ i386_init(void)
 		monitor(NULL);
 }
 
+// While boot_aps is booting a given CPU, it communicates the per-core
+// stack pointer that should be loaded by mpentry.S to that CPU in
+// this variable.
+void *mpentry_kstack;
+
+// How long to wait for an AP to report in.
+#define AP_BOOT_TIMEOUT_NS	(100 * NSEC_PER_MSEC)
+
+// Start the non-boot (AP) processors.
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	void *code;
+	struct CpuInfo *c;
+	uint64_t deadline;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	code = KADDR(MPENTRY_PADDR);
+	memmove(code, mpentry_start, mpentry_end - mpentry_start);
+
+	// Boot each AP one at a time
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == bootcpu)  // We've started already.
+			continue;
+
+		// Tell mpentry.S what stack to use
+		mpentry_kstack = percpu_kstacks[c - cpus] + KSTKSIZE;
+		// Start the CPU at mpentry_start
+		lapic_startap(c->cpu_apicid, PADDR(code));
+		// Wait for the CPU to finish some basic setup in mp_main()
+		deadline = ktime_get() + AP_BOOT_TIMEOUT_NS;
+		while (c->cpu_status != CPU_STARTED && ktime_get() < deadline)
+			asm volatile("pause");
+		// A CPU that is late rather than dead may still be about to
+		// load mpentry_kstack, so it cannot be pointed at the next
+		// CPU's stack: leave the rest of the CPUs stopped.
+		if (c->cpu_status != CPU_STARTED) {
+			cprintf("CPU %d (APIC %d) did not start; "
+				"not starting the rest\n",
+				c->cpu_id, c->cpu_apicid);
+			break;
+		}
+	}
+}
+
+// Setup code for APs
+void
+mp_main(void)
+{
+	// We are in high EIP now, safe to switch to kern_pgdir
+	mem_init_percpu();
+	gdt_init_percpu(lapic_cpunum());
+	bulk_init_percpu();
+	cprintf("SMP: CPU %d starting\n", cpunum());
+
+	lapic_init();
+	trap_init_percpu();
+	fpu_init_percpu();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Run tasks as sched_run() hands them out, halting in between.
+	lock_kernel();
+	sched_ap();
+}
 
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
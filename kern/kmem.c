@@ -0,0 +1,393 @@
+// Slab allocator for fixed-size kernel objects.
+//
+// Each Kmem_cache hands out objects of one size.  It carves them from
+// slabs, blocks of 2^kc_order pages from the buddy allocator, each
+// starting with a struct Slab.  The slab header keeps the free objects
+// as a linked list of indices rather than by writing into the objects,
+// so free objects keep whatever their constructor put there.
+//
+// Successive slabs start their objects at different offsets ("colours"),
+// a cache line apart, so that the first objects of every slab don't all
+// compete for the same few cache sets.
+//
+// On top of the slabs, each CPU has a small magazine of free objects.
+// kmem_cache_alloc() and kmem_cache_free() only reach the slab lists
+// when the magazine is empty or full.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/kmem.h>
+#include <kern/pmap.h>
+
+#define SLAB_END	0xFFFF	// End of a slab's free list
+
+struct Slab {
+	struct Slab *sl_next;		// Neighbours on the cache's list
+	struct Slab *sl_prev;
+	struct Kmem_cache *sl_cache;
+	char *sl_objs;			// Object 0, after the colour offset
+	int sl_inuse;			// Objects allocated from this slab
+	uint16_t sl_free;		// First free object, or SLAB_END
+	uint16_t sl_free_next[];	// Free list links, by object index
+};
+
+// The cache from which all caches are allocated, including itself.
+static struct Kmem_cache kmem_cache_cache;
+static struct Kmem_cache *kmem_caches;
+
+static void check_kmem(void);
+
+
+/***** Slab layer *****/
+
+static void
+slab_list_push(struct Slab **head, struct Slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *head;
+	if (*head)
+		(*head)->sl_prev = sl;
+	*head = sl;
+}
+
+static void
+slab_list_remove(struct Slab **head, struct Slab *sl)
+{
+	if (sl->sl_prev)
+		sl->sl_prev->sl_next = sl->sl_next;
+	else
+		*head = sl->sl_next;
+	if (sl->sl_next)
+		sl->sl_next->sl_prev = sl->sl_prev;
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+// Bytes from the start of a slab to its uncoloured object 0.
+static size_t
+slab_hdrsize(size_t align, int nobjs)
+{
+	return ROUNDUP(sizeof(struct Slab) + nobjs * sizeof(uint16_t), align);
+}
+
+static struct Slab *
+slab_create(struct Kmem_cache *kc)
+{
+	struct PageInfo *pp;
+	struct Slab *sl;
+	int i;
+
+	if (!(pp = page_alloc_order(kc->kc_order, 0)))
+		return NULL;
+	sl = page2kva(pp);
+	sl->sl_cache = kc;
+	sl->sl_inuse = 0;
+	sl->sl_objs = (char *) sl + slab_hdrsize(kc->kc_align, kc->kc_nobjs)
+		+ kc->kc_colour_next;
+	kc->kc_colour_next += MAX(kc->kc_align, KMEM_LINESIZE);
+	if (kc->kc_colour_next > kc->kc_colour_max)
+		kc->kc_colour_next = 0;
+
+	for (i = 0; i < kc->kc_nobjs; i++) {
+		sl->sl_free_next[i] = i + 1 < kc->kc_nobjs ? i + 1 : SLAB_END;
+		if (kc->kc_ctor)
+			kc->kc_ctor(sl->sl_objs + i * kc->kc_size);
+	}
+	sl->sl_free = 0;
+	kc->kc_nslabs++;
+	return sl;
+}
+
+static void
+slab_destroy(struct Kmem_cache *kc, struct Slab *sl)
+{
+	page_free(pa2page(PADDR(sl)));
+	kc->kc_nslabs--;
+}
+
+static void *
+slab_alloc_obj(struct Kmem_cache *kc)
+{
+	struct Slab *sl;
+	int i;
+
+	if (!(sl = kc->kc_partial)) {
+		if ((sl = kc->kc_empty))
+			slab_list_remove(&kc->kc_empty, sl);
+		else if (!(sl = slab_create(kc)))
+			return NULL;
+		slab_list_push(&kc->kc_partial, sl);
+	}
+
+	i = sl->sl_free;
+	sl->sl_free = sl->sl_free_next[i];
+	if (++sl->sl_inuse == kc->kc_nobjs) {
+		slab_list_remove(&kc->kc_partial, sl);
+		slab_list_push(&kc->kc_full, sl);
+	}
+	kc->kc_nactive++;
+	return sl->sl_objs + i * kc->kc_size;
+}
+
+static void
+slab_free_obj(struct Kmem_cache *kc, void *obj)
+{
+	struct Slab *sl;
+	size_t off;
+	int i;
+
+	// Slabs are buddy blocks, so aligned to their own size.
+	sl = ROUNDDOWN(obj, PGSIZE << kc->kc_order);
+	off = (char *) obj - sl->sl_objs;
+	if (sl->sl_cache != kc || off % kc->kc_size != 0
+	    || off / kc->kc_size >= kc->kc_nobjs)
+		panic("kmem_cache_free: %08x is not a %s object",
+		      obj, kc->kc_name);
+	i = off / kc->kc_size;
+
+	if (sl->sl_inuse-- == kc->kc_nobjs) {
+		slab_list_remove(&kc->kc_full, sl);
+		slab_list_push(&kc->kc_partial, sl);
+	}
+	sl->sl_free_next[i] = sl->sl_free;
+	sl->sl_free = i;
+	kc->kc_nactive--;
+
+	// Keep one empty slab around to absorb alloc/free churn.
+	if (sl->sl_inuse == 0) {
+		slab_list_remove(&kc->kc_partial, sl);
+		if (kc->kc_empty)
+			slab_destroy(kc, sl);
+		else
+			slab_list_push(&kc->kc_empty, sl);
+	}
+}
+
+
+/***** Caches *****/
+
+static int
+kmem_cache_setup(struct Kmem_cache *kc, const char *name, size_t size,
+		 size_t align, void (*ctor)(void *))
+{
+	size_t slabsize, waste;
+	int order, nobjs;
+
+	if (align == 0)
+		align = sizeof(void *);
+	if (size == 0 || (align & (align - 1)) != 0)
+		return -E_INVAL;
+
+	memset(kc, 0, sizeof(*kc));
+	strlcpy(kc->kc_name, name, sizeof(kc->kc_name));
+	kc->kc_size = ROUNDUP(size, align);
+	kc->kc_align = align;
+	kc->kc_ctor = ctor;
+
+	// Use the smallest slab that wastes no more than an eighth of
+	// itself, or failing that, the largest.
+	for (order = 0; order <= KMEM_MAXORDER; order++) {
+		slabsize = PGSIZE << order;
+		nobjs = (slabsize - sizeof(struct Slab))
+			/ (kc->kc_size + sizeof(uint16_t));
+		while (nobjs > 0 && slab_hdrsize(align, nobjs)
+		       + nobjs * kc->kc_size > slabsize)
+			nobjs--;
+		if (nobjs == 0)
+			continue;
+		waste = slabsize - slab_hdrsize(align, nobjs)
+			- nobjs * kc->kc_size;
+		kc->kc_order = order;
+		kc->kc_nobjs = nobjs;
+		kc->kc_colour_max = waste;
+		if (waste <= slabsize / 8)
+			break;
+	}
+	if (kc->kc_nobjs == 0)
+		return -E_INVAL;
+
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	return 0;
+}
+
+// Create a cache of objects of 'size' bytes, aligned to 'align' (a
+// power of two, or 0 for pointer alignment).  If 'ctor' is not NULL,
+// it is called on each object once, before the object is first
+// allocated.  Returns NULL if out of memory, or if the objects would
+// not fit in a slab.
+struct Kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct Kmem_cache *kc;
+
+	if (!(kc = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+	if (kmem_cache_setup(kc, name, size, align, ctor) < 0) {
+		kmem_cache_free(&kmem_cache_cache, kc);
+		return NULL;
+	}
+	return kc;
+}
+
+// Return up to n objects from a magazine to their slabs.
+static void
+kmem_magazine_flush(struct Kmem_cache *kc, struct Kmem_magazine *m, int n)
+{
+	while (n-- > 0 && m->km_nobj > 0)
+		slab_free_obj(kc, m->km_obj[--m->km_nobj]);
+}
+
+// Destroy a cache, all of whose objects must have been freed.
+static void
+kmem_cache_destroy(struct Kmem_cache *kc)
+{
+	struct Kmem_cache **kcp;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		kmem_magazine_flush(kc, &kc->kc_mag[i], KMEM_MAGSIZE);
+	if (kc->kc_nactive != 0)
+		panic("kmem_cache_destroy: %s has %u objects in use",
+		      kc->kc_name, kc->kc_nactive);
+	if (kc->kc_empty)
+		slab_destroy(kc, kc->kc_empty);
+
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next)
+		/* do nothing */;
+	*kcp = kc->kc_next;
+	kmem_cache_free(&kmem_cache_cache, kc);
+}
+
+// Allocate an object from cache 'kc'.  Returns NULL if out of memory.
+void *
+kmem_cache_alloc(struct Kmem_cache *kc)
+{
+	struct Kmem_magazine *m = &kc->kc_mag[cpunum()];
+
+	kc->kc_nalloc++;
+	if (m->km_nobj > 0) {
+		kc->kc_nmaghit++;
+		return m->km_obj[--m->km_nobj];
+	}
+	return slab_alloc_obj(kc);
+}
+
+// Return an object to the cache it was allocated from.  The object must
+// be in its constructed state.
+void
+kmem_cache_free(struct Kmem_cache *kc, void *obj)
+{
+	struct Kmem_magazine *m = &kc->kc_mag[cpunum()];
+	int i;
+
+	// When the magazine is full, return its older half to the slabs.
+	if (m->km_nobj == KMEM_MAGSIZE) {
+		for (i = 0; i < KMEM_MAGSIZE / 2; i++)
+			slab_free_obj(kc, m->km_obj[i]);
+		memmove(&m->km_obj[0], &m->km_obj[KMEM_MAGSIZE / 2],
+			KMEM_MAGSIZE / 2 * sizeof(m->km_obj[0]));
+		m->km_nobj = KMEM_MAGSIZE / 2;
+	}
+	m->km_obj[m->km_nobj++] = obj;
+}
+
+void
+kmem_init(void)
+{
+	if (kmem_cache_setup(&kmem_cache_cache, "kmem_cache",
+			     sizeof(struct Kmem_cache), KMEM_LINESIZE, NULL) < 0)
+		panic("kmem_init: can't set up the cache of caches");
+	check_kmem();
+}
+
+void
+kmem_print_slabinfo(void)
+{
+	struct Kmem_cache *kc;
+	size_t inmag;
+	int i;
+
+	cprintf("%-16s %6s %5s %6s %6s %5s %5s %10s %6s\n", "name",
+		"size", "align", "active", "total", "slabs", "pages",
+		"allocs", "maghit");
+	for (kc = kmem_caches; kc; kc = kc->kc_next) {
+		for (i = 0, inmag = 0; i < NCPU; i++)
+			inmag += kc->kc_mag[i].km_nobj;
+		cprintf("%-16s %6u %5u %6u %6u %5u %5u %10llu %5llu%%\n",
+			kc->kc_name, kc->kc_size, kc->kc_align,
+			kc->kc_nactive - inmag, kc->kc_nslabs * kc->kc_nobjs,
+			kc->kc_nslabs, 1 << kc->kc_order, kc->kc_nalloc,
+			kc->kc_nalloc ? kc->kc_nmaghit * 100 / kc->kc_nalloc
+			: 0);
+	}
+}
+
+
+/***** Self-test *****/
+
+#define CHECK_MAGIC	0xC0FFEE
+
+static void
+check_ctor(void *obj)
+{
+	*(uint32_t *) obj = CHECK_MAGIC;
+}
+
+static void
+check_kmem(void)
+{
+	static void *objs[512];
+	struct Kmem_cache *kc;
+	struct Slab *sl;
+	size_t nfree;
+	int i, j, n;
+
+	kc = kmem_cache_create("kmem_check", 100, 4, check_ctor);
+	assert(kc && kc->kc_size == 100 && kc->kc_order == 0);
+	assert(kc->kc_nobjs >= 32);
+	nfree = page_nfree();
+	n = MIN(ARRAY_SIZE(objs), 3 * kc->kc_nobjs + 5);
+
+	for (i = 0; i < n; i++) {
+		objs[i] = kmem_cache_alloc(kc);
+		assert(objs[i]);
+		assert((uintptr_t) objs[i] % 4 == 0);
+		assert(*(uint32_t *) objs[i] == CHECK_MAGIC);
+		for (j = 0; j < i; j++)
+			assert(objs[j] != objs[i]);
+		memset((char *) objs[i] + 4, i, kc->kc_size - 4);
+	}
+	assert(kc->kc_nslabs == 4 && kc->kc_nactive == n);
+	for (i = 0; i < n; i++)
+		for (j = 4; j < kc->kc_size; j++)
+			assert(((uint8_t *) objs[i])[j] == (uint8_t) i);
+
+	// Consecutive slabs start their objects at different colours.
+	if (kc->kc_colour_max >= KMEM_LINESIZE) {
+		sl = ROUNDDOWN(objs[0], PGSIZE);
+		assert(ROUNDDOWN(objs[kc->kc_nobjs], PGSIZE) != sl);
+		assert((uintptr_t) objs[0] % PGSIZE
+		       != (uintptr_t) objs[kc->kc_nobjs] % PGSIZE);
+	}
+
+	// Freed objects come back through the magazine, still
+	// constructed, newest first.
+	kmem_cache_free(kc, objs[0]);
+	assert(kmem_cache_alloc(kc) == objs[0]);
+	assert(kc->kc_nmaghit == 1);
+
+	for (i = 0; i < n; i++)
+		kmem_cache_free(kc, objs[i]);
+	assert(kc->kc_mag[cpunum()].km_nobj <= KMEM_MAGSIZE);
+	assert(kc->kc_nactive == kc->kc_mag[cpunum()].km_nobj);
+	assert(kc->kc_full == NULL);
+
+	kmem_cache_destroy(kc);
+	assert(page_nfree() == nfree);
+
+	cprintf("check_kmem() succeeded!\n");
+}
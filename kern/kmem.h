@@ -0,0 +1,61 @@
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+#define KMEM_NAMELEN	16	// longest cache name, with its null
+#define KMEM_MAGSIZE	16	// objects held by each per-CPU magazine
+#define KMEM_MAXORDER	3	// largest slab: 2^KMEM_MAXORDER pages
+#define KMEM_LINESIZE	64	// cache line size, the colouring step
+
+struct Slab;
+
+// A per-CPU stack of free, constructed objects, so that most allocations
+// and frees never touch the shared slab lists.
+struct Kmem_magazine {
+	int km_nobj;
+	void *km_obj[KMEM_MAGSIZE];
+};
+
+// A cache of equally sized objects, carved from slabs of 2^kc_order
+// pages.  Free objects stay constructed: kc_ctor runs once per object,
+// when its slab is created, not on every allocation.
+struct Kmem_cache {
+	char kc_name[KMEM_NAMELEN];
+	size_t kc_size;			// Object size, rounded up to kc_align
+	size_t kc_align;		// Object alignment
+	void (*kc_ctor)(void *obj);	// Constructor (may be NULL)
+
+	int kc_order;			// Slab size is 2^kc_order pages
+	int kc_nobjs;			// Objects per slab
+	size_t kc_colour_max;		// Largest colour offset that fits
+	size_t kc_colour_next;		// Colour offset for the next slab
+
+	// Slabs with some, none or all of their objects free
+	struct Slab *kc_partial;
+	struct Slab *kc_full;
+	struct Slab *kc_empty;
+
+	struct Kmem_magazine kc_mag[NCPU];
+
+	// Statistics
+	size_t kc_nslabs;		// Slabs currently allocated
+	size_t kc_nactive;		// Objects handed out by the slab layer
+	uint64_t kc_nalloc;		// Calls to kmem_cache_alloc
+	uint64_t kc_nmaghit;		// ... satisfied from a magazine
+
+	struct Kmem_cache *kc_next;	// Next on the list of all caches
+};
+
+void	kmem_init(void);
+struct Kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *));
+void *	kmem_cache_alloc(struct Kmem_cache *kc);
+void	kmem_cache_free(struct Kmem_cache *kc, void *obj);
+void	kmem_print_slabinfo(void);
+
+#endif	// !JOS_KERN_KMEM_H
@@ -0,0 +1,270 @@
+// The local APIC manages internal (non-I/O) interrupts.
+// See Chapter 8 & Appendix C of Intel processor manual volume 3.
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/kclock.h>
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define DEASSERT   0x00000000
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+	#define OTHERS     0x000C0000   // Send to all APICs, excluding self.
+	#define BUSY       0x00001000
+	#define FIXED      0x00000000
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define X1         0x0000000B   // divide counts by 1
+	#define ONESHOT    0x00000000   // One-shot
+	#define TSCDEADLINE 0x00040000  // Interrupt when the TSC reaches
+					// MSR_IA32_TSC_DEADLINE
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+
+#define TIMER_CAL_NS	(10 * NSEC_PER_MSEC)	// timer calibration time
+
+physaddr_t lapicaddr;        // Initialized in lapic_init()
+volatile uint32_t *lapic;
+
+// The timer counts down at lapic_timer_khz, unless it runs off the TSC.
+static uint32_t lapic_timer_khz;
+static bool lapic_tsc_deadline;
+
+static void
+lapicw(int index, int value)
+{
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+// Set up the timer to interrupt once, when lapic_timer_arm() asks.
+// Use TSC-deadline mode if the CPU has it: then the deadline is in the
+// kernel's own clock.  Otherwise count down at the bus clock, which we
+// measure against the TSC.
+static void
+lapic_timer_init(void)
+{
+	uint32_t ecx;
+	uint64_t t0;
+
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	if (ecx & CPUID_ECX_TSC_DEADLINE) {
+		lapic_tsc_deadline = 1;
+		lapicw(TIMER, TSCDEADLINE | (IRQ_OFFSET + IRQ_TIMER));
+		return;
+	}
+
+	// Every CPU's timer counts at the same rate: only the BSP
+	// measures it.
+	lapicw(TDCR, X1);
+	if (lapic_timer_khz) {
+		lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+		return;
+	}
+	lapicw(TIMER, ONESHOT | MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xFFFFFFFF);
+	t0 = read_tsc();
+	while (read_tsc() - t0 < ns_to_tsc(TIMER_CAL_NS))
+		/* do nothing */;
+	lapic_timer_khz = (0xFFFFFFFF - lapic[TCCR])
+		/ (TIMER_CAL_NS / NSEC_PER_MSEC);
+	lapicw(TICR, 0);
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+}
+
+void
+lapic_init(void)
+{
+	uint32_t edx;
+
+	if (!lapicaddr) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		if (!(edx & CPUID_EDX_APIC))
+			return;
+		lapicaddr = rdmsr(MSR_IA32_APIC_BASE) & ~(PGSIZE - 1);
+	}
+
+	// lapicaddr is the physical address of the LAPIC's 4K MMIO
+	// region.  Map it in to virtual memory so we can access it.
+	// Every CPU sees its own LAPIC there, so the BSP maps it for all.
+	if (!lapic)
+		lapic = mmio_map_region(lapicaddr, 4096);
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+	// No periodic tick: the timer only fires for the next timer
+	// that is due.
+	lapic_timer_init();
+
+	// Leave LINT0 of the BSP enabled so that it can get
+	// interrupts from the 8259A chip.
+	//
+	// According to Intel MP Specification, the BIOS should initialize
+	// BSP's local APIC in Virtual Wire Mode, in which 8259A's
+	// INTR is virtually connected to BSP's LINTIN0. In this mode,
+	// we do not need to program the IOAPIC.
+
+	// Disable NMI (LINT1) on all CPUs
+	lapicw(LINT1, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// Map error interrupt to IRQ_ERROR.
+	lapicw(ERROR, IRQ_OFFSET + IRQ_ERROR);
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+
+	if (thiscpu != bootcpu)
+		return;
+	if (lapic_tsc_deadline)
+		cprintf("LAPIC timer: TSC deadline\n");
+	else
+		cprintf("LAPIC timer: one-shot, %u.%03u MHz\n",
+			lapic_timer_khz / 1000, lapic_timer_khz % 1000);
+}
+
+// The index in cpus[] of the CPU we are running on, from its LAPIC
+// ID.  Only for bringing up a CPU: after gdt_init_percpu(), cpunum()
+// is one load.
+int
+lapic_cpunum(void)
+{
+	int i, id;
+
+	if (!lapic)
+		return 0;
+	id = lapic[ID] >> 24;
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_apicid == id)
+			return i;
+	return 0;
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void)
+{
+	if (lapic)
+		lapicw(EOI, 0);
+}
+
+// Spin for the given number of microseconds.
+static void
+microdelay(int us)
+{
+	uint64_t end = ktime_get() + us * NSEC_PER_USEC;
+
+	while (ktime_get() < end)
+		asm volatile("pause");
+}
+
+// Start additional processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startap(uint8_t apicid, uint32_t addr)
+{
+	int i;
+	uint16_t *wrv;
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	outb(IO_RTC, 0xF);  // offset 0xF is shutdown code
+	outb(IO_RTC+1, 0x0A);
+	wrv = (uint16_t *)KADDR((0x40 << 4 | 0x67));  // Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// "Universal startup algorithm."
+	// Send INIT (level-triggered) interrupt to reset other CPU.
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	microdelay(200);
+	lapicw(ICRLO, INIT | LEVEL);
+	microdelay(10000);
+
+	// Send startup IPI (twice!) to enter code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	for (i = 0; i < 2; i++) {
+		lapicw(ICRHI, apicid << 24);
+		lapicw(ICRLO, STARTUP | (addr >> 12));
+		microdelay(200);
+	}
+}
+
+// Send interrupt 'vector' to the CPU with LAPIC ID 'apicid'.
+void
+lapic_ipi(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Interrupt once, at ktime 'deadline' or as soon as possible if that
+// has passed, replacing any earlier request.  A deadline of ~0 cancels
+// the request.  A far deadline may interrupt early, when the count
+// runs out; the caller just asks again.
+void
+lapic_timer_arm(uint64_t deadline)
+{
+	uint64_t now, ns, count;
+
+	if (!lapic)
+		return;
+	if (lapic_tsc_deadline) {
+		wrmsr(MSR_IA32_TSC_DEADLINE,
+		      deadline == ~0ULL ? 0 : tsc_base + ns_to_tsc(deadline));
+		return;
+	}
+
+	if (deadline == ~0ULL) {
+		lapicw(TICR, 0);
+		return;
+	}
+	now = ktime_get();
+	ns = deadline > now ? deadline - now : 0;
+	count = ns / NSEC_PER_MSEC * lapic_timer_khz
+		+ ns % NSEC_PER_MSEC * lapic_timer_khz / NSEC_PER_MSEC;
+	lapicw(TICR, MAX(MIN(count, 0xFFFFFFFF), 1));
+}
@@ -10,6 +10,17 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
+#include <kern/ftrace.h>
+#include <kern/bench.h>
+#include <kern/bulk.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/syscall.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -24,6 +35,18 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "ftrace", "Function tracer: ftrace [on|off|clear|stats|graph [n]]", mon_ftrace },
+	{ "bench", "Run a microbenchmark: bench [name|all [sizes...]]", mon_bench },
+	{ "buddyinfo", "Display free physical memory by block size", mon_buddyinfo },
+	{ "slabinfo", "Display kernel object cache usage", mon_slabinfo },
+	{ "tlbstat", "Measure TLB misses across CR3 reloads: tlbstat [switches]", mon_tlbstat },
+	{ "sysprobe", "Time null system calls, int vs. sysenter: sysprobe [calls]", mon_sysprobe },
+	{ "time", "Display the clock frequency, uptime and wall clock time", mon_time },
+	{ "sleep", "Halt for a while and report how late we woke: sleep <ms>", mon_sleep },
+	{ "timers", "Display timer overhead, after a load test: timers [ntimers]", mon_timers },
+	{ "sched", "Display scheduling latency, after a demo: sched [ntasks]", mon_sched },
+	{ "spawn", "Time a tree of tasks that each create two more: spawn [depth]", mon_spawn },
+	{ "lockstat", "Display lock contention statistics: lockstat [reset]", mon_lockstat },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -51,6 +74,8 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
 	cprintf("Kernel executable memory footprint: %dKB\n",
 		ROUNDUP(end - entry, 1024) / 1024);
+	cprintf("Memory copy and set strategies:\n");
+	bulk_print_tunables();
 	return 0;
 }
 
@@ -81,6 +106,133 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_ftrace(int argc, char **argv, struct Trapframe *tf)
+{
+#ifndef FTRACE
+	cprintf("Kernel not built with FTRACE=1; no trace available.\n");
+#else
+	if (argc < 2 || strcmp(argv[1], "stats") == 0)
+		ftrace_print_stats();
+	else if (strcmp(argv[1], "graph") == 0)
+		ftrace_print_graph(argc > 2 ? strtol(argv[2], 0, 0) : 40);
+	else if (strcmp(argv[1], "on") == 0)
+		ftrace_enable(1);
+	else if (strcmp(argv[1], "off") == 0)
+		ftrace_enable(0);
+	else if (strcmp(argv[1], "clear") == 0)
+		ftrace_clear();
+	else
+		cprintf("Usage: ftrace [on|off|clear|stats|graph [n]]\n");
+#endif
+	return 0;
+}
+
+int
+mon_bench(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t sizes[BENCH_MAXSIZES];
+	int n;
+
+	if (argc < 2) {
+		bench_list();
+		return 0;
+	}
+	for (n = 0; n + 2 < argc && n < BENCH_MAXSIZES; n++)
+		sizes[n] = strtol(argv[n + 2], 0, 0);
+	if (bench_run(argv[1], sizes, n) < 0)
+		cprintf("Unknown benchmark '%s'\n", argv[1]);
+	return 0;
+}
+
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_buddyinfo();
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_slabinfo();
+	return 0;
+}
+
+int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf)
+{
+	tlb_print_stats(argc > 1 ? strtol(argv[1], 0, 0) : 1000);
+	return 0;
+}
+
+int
+mon_sysprobe(int argc, char **argv, struct Trapframe *tf)
+{
+	syscall_probe(argc > 1 ? strtol(argv[1], 0, 0) : 10000);
+	return 0;
+}
+
+int
+mon_time(int argc, char **argv, struct Trapframe *tf)
+{
+	time_print();
+	return 0;
+}
+
+int
+mon_sleep(int argc, char **argv, struct Trapframe *tf)
+{
+	long ms;
+	uint64_t ns, t0, t;
+
+	if (argc != 2 || (ms = strtol(argv[1], 0, 0)) < 0) {
+		cprintf("Usage: sleep <ms>\n");
+		return 0;
+	}
+	ns = ms * NSEC_PER_MSEC;
+	t0 = ktime_get();
+	timer_sleep(ns);
+	t = ktime_get() - t0;
+	cprintf("slept %llu ns, %llu ns late\n", t, t - ns);
+	return 0;
+}
+
+int
+mon_timers(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1)
+		timer_stress(strtol(argv[1], 0, 0));
+	timer_print_stats();
+	return 0;
+}
+
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1)
+		sched_demo(strtol(argv[1], 0, 0));
+	sched_print_stats();
+	fpu_print_stats();
+	return 0;
+}
+
+int
+mon_spawn(int argc, char **argv, struct Trapframe *tf)
+{
+	sched_spawn(argc > 1 ? strtol(argv[1], 0, 0) : 7);
+	return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+		lockstat_reset();
+	else
+		lockstat_print();
+	return 0;
+}
 
 
 /***** Kernel monitor command interpreter *****/
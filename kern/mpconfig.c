@@ -0,0 +1,394 @@
+// Search for and parse the multiprocessor configuration table
+// See http://developer.intel.com/design/pentium/datashts/24201606.pdf
+// and the ACPI specification's Multiple APIC Description Table.
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+
+struct CpuInfo cpus[NCPU];
+struct CpuInfo *bootcpu;
+int ismp;
+int ncpu;
+
+
+// See MultiProcessor Specification Version 1.[14]
+
+struct mp {             // floating pointer [MP 4.1]
+	uint8_t signature[4];           // "_MP_"
+	physaddr_t physaddr;            // phys addr of MP config table
+	uint8_t length;                 // 1
+	uint8_t specrev;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t type;                   // MP system config type
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct mpconf {         // configuration table header [MP 4.2]
+	uint8_t signature[4];           // "PCMP"
+	uint16_t length;                // total table length
+	uint8_t version;                // [14]
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t product[20];            // product id
+	physaddr_t oemtable;            // OEM table pointer
+	uint16_t oemlength;             // OEM table length
+	uint16_t entry;                 // entry count
+	physaddr_t lapicaddr;           // address of local APIC
+	uint16_t xlength;               // extended table length
+	uint8_t xchecksum;              // extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];             // table entries
+} __attribute__((__packed__));
+
+struct mpproc {         // processor table entry [MP 4.3.1]
+	uint8_t type;                   // entry type (0)
+	uint8_t apicid;                 // local APIC id
+	uint8_t version;                // local APIC version
+	uint8_t flags;                  // CPU flags
+	uint8_t signature[4];           // CPU signature
+	uint32_t feature;               // feature flags from CPUID instruction
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+// mpproc flags
+#define MPPROC_ENABLED 0x01             // This mpproc is usable
+#define MPPROC_BOOT 0x02                // This mpproc is the bootstrap processor
+
+// Table entry types
+#define MPPROC    0x00  // One per processor
+#define MPBUS     0x01  // One per bus
+#define MPIOAPIC  0x02  // One per I/O APIC
+#define MPIOINTR  0x03  // One per bus interrupt source
+#define MPLINTR   0x04  // One per system interrupt source
+
+// ACPI structures [ACPI 5.2]
+
+struct acpi_rsdp {      // root system description pointer [ACPI 5.2.5]
+	uint8_t signature[8];           // "RSD PTR "
+	uint8_t checksum;               // first 20 bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t revision;
+	physaddr_t rsdt;                // phys addr of the RSDT
+	// ACPI 2.0 adds a 64-bit XSDT address; the RSDT is enough here
+} __attribute__((__packed__));
+
+struct acpi_header {    // header of every description table [ACPI 5.2.6]
+	uint8_t signature[4];
+	uint32_t length;                // total table length
+	uint8_t revision;
+	uint8_t checksum;               // all bytes must add up to 0
+	uint8_t oemid[6];
+	uint8_t oemtableid[8];
+	uint32_t oemrevision;
+	uint32_t creatorid;
+	uint32_t creatorrevision;
+} __attribute__((__packed__));
+
+struct acpi_madt {      // multiple APIC description table [ACPI 5.2.12]
+	struct acpi_header hdr;         // "APIC"
+	physaddr_t lapicaddr;           // address of local APIC
+	uint32_t flags;
+	uint8_t entries[0];             // interrupt controller structures
+} __attribute__((__packed__));
+
+struct madt_lapic {     // processor local APIC structure [ACPI 5.2.12.2]
+	uint8_t type;                   // entry type (0)
+	uint8_t length;                 // 8
+	uint8_t acpiid;                 // ACPI processor id
+	uint8_t apicid;                 // local APIC id
+	uint32_t flags;
+} __attribute__((__packed__));
+
+// madt_lapic flags
+#define MADT_LAPIC_ENABLED 0x01         // This processor is usable
+
+// MADT entry types
+#define MADT_LAPIC 0x00 // One per processor
+
+static uint8_t
+sum(void *addr, int len)
+{
+	int i, sum;
+
+	sum = 0;
+	for (i = 0; i < len; i++)
+		sum += ((uint8_t *)addr)[i];
+	return sum;
+}
+
+// Return a pointer to the 'len' bytes of firmware tables at physical
+// address 'pa'.  The BIOS may put them in reserved memory above the
+// RAM that KADDR reaches; map those in the MMIO region.
+static void *
+fw_kaddr(physaddr_t pa, size_t len)
+{
+	if (PGNUM(pa + len - 1) < npages)
+		return KADDR(pa);
+	return mmio_map_region(pa, len);
+}
+
+// Look for an MP structure in the len bytes at physical address addr.
+static struct mp *
+mpsearch1(physaddr_t a, int len)
+{
+	struct mp *mp = KADDR(a), *end = KADDR(a + len);
+
+	for (; mp < end; mp++)
+		if (memcmp(mp->signature, "_MP_", 4) == 0 &&
+		    sum(mp, sizeof(*mp)) == 0)
+			return mp;
+	return NULL;
+}
+
+// Look for the ACPI RSDP in the len bytes at physical address addr.
+// It is on a 16-byte boundary.
+static struct acpi_rsdp *
+rsdpsearch1(physaddr_t a, int len)
+{
+	uint8_t *p = KADDR(a), *end = KADDR(a + len);
+
+	for (; p < end; p += 16)
+		if (memcmp(p, "RSD PTR ", 8) == 0 &&
+		    sum(p, sizeof(struct acpi_rsdp)) == 0)
+			return (struct acpi_rsdp *) p;
+	return NULL;
+}
+
+// The physical address of the first KB of the EBDA, or, if there is
+// no EBDA, of the last KB of system base memory.  Both the MP floating
+// pointer [MP 4] and the ACPI RSDP [ACPI 5.2.5.1] may be there.
+static physaddr_t
+ebda(void)
+{
+	uint8_t *bda;
+	uint32_t p;
+
+	// The BIOS data area lives in 16-bit segment 0x40.
+	bda = (uint8_t *) KADDR(0x40 << 4);
+
+	// [MP 4] The 16-bit segment of the EBDA is in the two bytes
+	// starting at byte 0x0E of the BDA.  0 if not present.
+	if ((p = *(uint16_t *) (bda + 0x0E)))
+		return p << 4;	// Translate from segment to PA
+	// The size of base memory, in KB is in the two bytes
+	// starting at 0x13 of the BDA.
+	p = *(uint16_t *) (bda + 0x13) * 1024;
+	return p - 1024;
+}
+
+// Search for the MP Floating Pointer Structure, which according to
+// [MP 4] is in one of the following three locations:
+// 1) in the first KB of the EBDA;
+// 2) if there is no EBDA, in the last KB of system base memory;
+// 3) in the BIOS ROM between 0xF0000 and 0xFFFFF.
+static struct mp *
+mpsearch(void)
+{
+	struct mp *mp;
+
+	static_assert(sizeof(*mp) == 16);
+
+	if ((mp = mpsearch1(ebda(), 1024)))
+		return mp;
+	return mpsearch1(0xF0000, 0x10000);
+}
+
+// Search for an MP configuration table.  For now, don't accept the
+// default configurations (physaddr == 0).
+// Check for the correct signature, checksum, and version.
+static struct mpconf *
+mpconfig(struct mp **pmp)
+{
+	struct mpconf *conf;
+	struct mp *mp;
+
+	if ((mp = mpsearch()) == 0)
+		return NULL;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: Default configurations not implemented\n");
+		return NULL;
+	}
+	conf = (struct mpconf *) fw_kaddr(mp->physaddr, sizeof(*conf));
+	if (memcmp(conf, "PCMP", 4) != 0) {
+		cprintf("SMP: Incorrect MP configuration table signature\n");
+		return NULL;
+	}
+	if (PGNUM(mp->physaddr + conf->length + conf->xlength - 1) >= npages)
+		conf = fw_kaddr(mp->physaddr, conf->length + conf->xlength);
+	if (sum(conf, conf->length) != 0) {
+		cprintf("SMP: Bad MP configuration checksum\n");
+		return NULL;
+	}
+	if (conf->version != 1 && conf->version != 4) {
+		cprintf("SMP: Unsupported MP version %d\n", conf->version);
+		return NULL;
+	}
+	if ((sum((uint8_t *)conf + conf->length, conf->xlength) + conf->xchecksum) & 0xff) {
+		cprintf("SMP: Bad MP configuration extended checksum\n");
+		return NULL;
+	}
+	*pmp = mp;
+	return conf;
+}
+
+// Find the MADT through the RSDP and RSDT, which [ACPI 5.2.5.1] puts
+// in the first KB of the EBDA or in the BIOS ROM between 0xE0000 and
+// 0xFFFFF.
+static struct acpi_madt *
+madtsearch(void)
+{
+	struct acpi_rsdp *rsdp;
+	struct acpi_header *rsdt, *hdr;
+	physaddr_t *entry;
+	int i, n;
+
+	static_assert(sizeof(*rsdp) == 20);
+
+	if (!(rsdp = rsdpsearch1(ebda(), 1024))
+	    && !(rsdp = rsdpsearch1(0xE0000, 0x20000)))
+		return NULL;
+	rsdt = fw_kaddr(rsdp->rsdt, sizeof(*rsdt));
+	if (memcmp(rsdt->signature, "RSDT", 4) != 0)
+		return NULL;
+	rsdt = fw_kaddr(rsdp->rsdt, rsdt->length);
+	if (sum(rsdt, rsdt->length) != 0) {
+		cprintf("SMP: Bad ACPI RSDT checksum\n");
+		return NULL;
+	}
+
+	entry = (physaddr_t *) (rsdt + 1);
+	n = (rsdt->length - sizeof(*rsdt)) / sizeof(*entry);
+	for (i = 0; i < n; i++) {
+		hdr = fw_kaddr(entry[i], sizeof(*hdr));
+		if (memcmp(hdr->signature, "APIC", 4) != 0)
+			continue;
+		hdr = fw_kaddr(entry[i], hdr->length);
+		if (sum(hdr, hdr->length) != 0) {
+			cprintf("SMP: Bad ACPI MADT checksum\n");
+			return NULL;
+		}
+		return (struct acpi_madt *) hdr;
+	}
+	return NULL;
+}
+
+// Record a CPU.  The BSP always gets cpus[0], the one it has used
+// since boot.
+static void
+mp_addcpu(uint8_t apicid, bool isboot)
+{
+	struct CpuInfo *c;
+
+	if (isboot)
+		c = &cpus[0];
+	else if (ncpu < NCPU)
+		c = &cpus[ncpu++];
+	else {
+		cprintf("SMP: too many CPUs, CPU %d disabled\n", apicid);
+		return;
+	}
+	c->cpu_apicid = apicid;
+}
+
+// Count the enabled processors in the MADT.  The BSP is the one whose
+// APIC ID this CPU reports.
+static bool
+mp_init_madt(struct acpi_madt *madt)
+{
+	struct madt_lapic *lp;
+	uint8_t *p, *end;
+
+	lapicaddr = madt->lapicaddr;
+	end = (uint8_t *) madt + madt->hdr.length;
+	for (p = madt->entries; p + 2 <= end && p[1] >= 2; p += p[1]) {
+		if (p[0] != MADT_LAPIC)
+			continue;
+		lp = (struct madt_lapic *) p;
+		if (lp->flags & MADT_LAPIC_ENABLED)
+			mp_addcpu(lp->apicid,
+				  lp->apicid == cpus[0].cpu_apicid);
+	}
+	return 1;
+}
+
+static bool
+mp_init_mpconf(struct mp *mp, struct mpconf *conf)
+{
+	struct mpproc *proc;
+	uint8_t *p;
+	unsigned int i;
+
+	lapicaddr = conf->lapicaddr;
+
+	for (p = conf->entries, i = 0; i < conf->entry; i++) {
+		switch (*p) {
+		case MPPROC:
+			proc = (struct mpproc *)p;
+			if (proc->flags & MPPROC_ENABLED)
+				mp_addcpu(proc->apicid,
+					  proc->flags & MPPROC_BOOT);
+			p += sizeof(struct mpproc);
+			continue;
+		case MPBUS:
+		case MPIOAPIC:
+		case MPIOINTR:
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			cprintf("mpinit: unknown config type %x\n", *p);
+			return 0;
+		}
+	}
+
+	if (mp->imcrp) {
+		// [MP 3.2.6.1] If the hardware implements PIC mode,
+		// switch to getting interrupts from the LAPIC.
+		cprintf("SMP: Setting IMCR to switch from PIC mode to symmetric I/O mode\n");
+		outb(0x22, 0x70);   // Select IMCR
+		outb(0x23, inb(0x23) | 1);  // Mask external interrupts.
+	}
+	return 1;
+}
+
+void
+mp_init(void)
+{
+	struct acpi_madt *madt;
+	struct mp *mp;
+	struct mpconf *conf;
+	uint32_t ebx;
+	int i;
+
+	// This CPU, the BSP, has been cpus[0] all along.  CPUID reports
+	// its initial APIC ID.
+	bootcpu = &cpus[0];
+	ncpu = 1;
+	cpuid(1, NULL, &ebx, NULL, NULL);
+	bootcpu->cpu_apicid = ebx >> 24;
+
+	// Prefer ACPI, which firmware still provides; fall back to the
+	// MP tables of older machines.
+	if ((madt = madtsearch()))
+		ismp = mp_init_madt(madt);
+	else if ((conf = mpconfig(&mp)))
+		ismp = mp_init_mpconf(mp, conf);
+
+	for (i = 0; i < NCPU; i++)
+		cpus[i].cpu_id = i;
+	bootcpu->cpu_status = CPU_STARTED;
+	if (!ismp) {
+		// Didn't like what we found; fall back to no MP.
+		ncpu = 1;
+		lapicaddr = 0;
+		cprintf("SMP: configuration not found, SMP disabled\n");
+		return;
+	}
+	cprintf("SMP: CPU %d found %d CPU(s) in the %s\n", bootcpu->cpu_id,
+		ncpu, madt ? "ACPI MADT" : "MP configuration table");
+}
@@ -0,0 +1,957 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/multiboot.h>
+
+#include <kern/pmap.h>
+#include <kern/kclock.h>
+#include <kern/bulk.h>
+#include <kern/cpu.h>
+
+// These variables are set by i386_detect_memory()
+size_t npages;			// Amount of physical memory (in pages)
+
+// Ranges of usable RAM, also set by i386_detect_memory(), sorted and
+// not overlapping.
+#define NMEMRANGE	32
+static struct Mem_range {
+	physaddr_t mr_start;
+	physaddr_t mr_end;
+} mem_ranges[NMEMRANGE];
+static int nmem_ranges;
+
+// Physical memory below this address is mapped at KERNBASE, so it's all
+// the allocator can hand out.  entry_pgdir maps the first 4MB;
+// mem_init() raises it to the top of RAM once kern_pgdir maps it all.
+static physaddr_t direct_map_top = PTSIZE;
+
+// The most physical memory the window from KERNBASE to 4GB can map.
+#define DIRECT_MAP_MAX	((physaddr_t) -KERNBASE)
+
+// These variables are set in mem_init()
+pde_t *kern_pgdir;		// Kernel's initial page directory
+struct PageInfo *pages;		// Physical page state array
+
+// PTE_G if the CPU supports global pages, so that the kernel's mappings
+// stay in the TLB when CR3 is reloaded.  Set in mem_init().
+static uint32_t pte_global;
+
+// The PTE bits that select write-combining: PTE_PWT, once pat_init()
+// has made PAT entry 1 write-combining; or uncached, if there is no PAT.
+static uint32_t pte_wc = PTE_PCD | PTE_PWT;
+
+// Buddy free lists: free_area[k] holds the free blocks of 2^k pages,
+// each aligned to its own size.
+static struct Free_area {
+	struct PageInfo *fa_head;
+	size_t fa_nfree;
+} free_area[BUDDY_MAXORDER + 1];
+
+
+// --------------------------------------------------------------
+// Detect machine's physical memory setup.
+// --------------------------------------------------------------
+
+static int
+nvram_read(int r)
+{
+	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
+}
+
+static void
+mem_range_add(physaddr_t start, physaddr_t end)
+{
+	// Leave out the I/O hole, whatever the memory map says.
+	if (start < EXTPHYSMEM && end > IOPHYSMEM) {
+		if (start < IOPHYSMEM)
+			mem_range_add(start, IOPHYSMEM);
+		if (end > EXTPHYSMEM)
+			mem_range_add(EXTPHYSMEM, end);
+		return;
+	}
+	if (start >= end)
+		return;
+	if (nmem_ranges == NMEMRANGE) {
+		cprintf("mem_range_add: dropping [%08x, %08x)\n", start, end);
+		return;
+	}
+	mem_ranges[nmem_ranges].mr_start = start;
+	mem_ranges[nmem_ranges].mr_end = end;
+	nmem_ranges++;
+}
+
+// Sort mem_ranges by address, merging any that overlap or touch, as
+// BIOS memory maps need not be in order and may repeat themselves.
+static void
+mem_ranges_normalize(void)
+{
+	struct Mem_range tmp;
+	int i, j;
+
+	for (i = 1; i < nmem_ranges; i++)
+		for (j = i; j > 0 && mem_ranges[j].mr_start
+			     < mem_ranges[j - 1].mr_start; j--) {
+			tmp = mem_ranges[j];
+			mem_ranges[j] = mem_ranges[j - 1];
+			mem_ranges[j - 1] = tmp;
+		}
+	for (i = 0, j = 1; j < nmem_ranges; j++)
+		if (mem_ranges[j].mr_start <= mem_ranges[i].mr_end)
+			mem_ranges[i].mr_end = MAX(mem_ranges[i].mr_end,
+						   mem_ranges[j].mr_end);
+		else
+			mem_ranges[++i] = mem_ranges[j];
+	if (nmem_ranges > 0)
+		nmem_ranges = i + 1;
+}
+
+// Fill in mem_ranges from the memory map the boot loader passed, if it
+// passed one.  Returns the number of ranges found.
+static int
+multiboot_detect_memory(void)
+{
+	extern uint32_t multiboot_magic, multiboot_info;
+	struct Multiboot_info *mbi;
+	struct Multiboot_mmap *mm;
+	uint32_t p, end;
+	uint64_t top;
+
+	// The boot loader leaves its structures in low memory, which
+	// entry_pgdir maps at KERNBASE.
+	if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC
+	    || multiboot_info > PTSIZE - sizeof(*mbi))
+		return 0;
+	mbi = (struct Multiboot_info *) (multiboot_info + KERNBASE);
+	if (!(mbi->mi_flags & MULTIBOOT_INFO_MEM_MAP)
+	    || mbi->mi_mmap_addr > PTSIZE
+	    || mbi->mi_mmap_length > PTSIZE - mbi->mi_mmap_addr)
+		return 0;
+
+	end = mbi->mi_mmap_addr + mbi->mi_mmap_length;
+	for (p = mbi->mi_mmap_addr; p + sizeof(*mm) <= end;
+	     p += mm->mm_size + sizeof(mm->mm_size)) {
+		mm = (struct Multiboot_mmap *) (p + KERNBASE);
+		// We can only use what a 32-bit physical address reaches.
+		if (mm->mm_type != MULTIBOOT_MEMORY_AVAILABLE
+		    || mm->mm_addr >= 0x100000000ULL)
+			continue;
+		top = MIN(mm->mm_addr + mm->mm_len, 0x100000000ULL - PGSIZE);
+		mem_range_add(mm->mm_addr, top);
+	}
+	return nmem_ranges;
+}
+
+static void
+i386_detect_memory(void)
+{
+	size_t basemem, extmem, ext16mem, totalmem;
+	const char *source = "BIOS memory map";
+	int i;
+
+	if (!multiboot_detect_memory()) {
+		// Use CMOS calls to measure available base & extended
+		// memory.  (CMOS calls return results in kilobytes.)
+		basemem = nvram_read(NVRAM_BASELO);
+		extmem = nvram_read(NVRAM_EXTLO);
+		ext16mem = nvram_read(NVRAM_EXT16LO) * 64;
+
+		mem_range_add(0, basemem * 1024);
+		if (ext16mem)
+			mem_range_add(EXTPHYSMEM, (16 * 1024 + ext16mem) * 1024);
+		else if (extmem)
+			mem_range_add(EXTPHYSMEM, (1 * 1024 + extmem) * 1024);
+		source = "CMOS";
+	}
+	mem_ranges_normalize();
+
+	// Calculate the number of physical pages, up to the top of the
+	// highest range, and how much of that is actually RAM.
+	npages = basemem = totalmem = 0;
+	for (i = 0; i < nmem_ranges; i++) {
+		npages = MAX(npages, PGNUM(ROUNDUP(mem_ranges[i].mr_end, PGSIZE)));
+		totalmem += (mem_ranges[i].mr_end - mem_ranges[i].mr_start) / 1024;
+		if (mem_ranges[i].mr_start < IOPHYSMEM)
+			basemem += (mem_ranges[i].mr_end - mem_ranges[i].mr_start) / 1024;
+	}
+
+	cprintf("Physical memory: %uK available, base = %uK, extended = %uK (%s)\n",
+		totalmem, basemem, totalmem - basemem, source);
+
+	// The kernel can only use the memory it can map at KERNBASE.
+	if (npages > PGNUM(DIRECT_MAP_MAX)) {
+		cprintf("Using only the first %uM of physical memory\n",
+			DIRECT_MAP_MAX / (1024 * 1024));
+		npages = PGNUM(DIRECT_MAP_MAX);
+	}
+}
+
+
+// --------------------------------------------------------------
+// Set up memory mappings above UTOP.
+// --------------------------------------------------------------
+
+static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size,
+			    physaddr_t pa, int perm);
+static void mem_init_mp(void);
+static void page_free_ranges(physaddr_t lo, physaddr_t hi);
+static void pat_init(void);
+static void check_buddy(void);
+static void check_kern_pgdir(void);
+
+// This simple physical memory allocator is used only while JOS is setting
+// up its virtual memory system.  page_alloc() is the real allocator.
+//
+// If n>0, allocates enough pages of contiguous physical memory to hold 'n'
+// bytes.  Doesn't initialize the memory.  Returns a kernel virtual address.
+//
+// If n==0, returns the address of the next free page without allocating
+// anything.
+//
+// If we're out of memory, boot_alloc should panic.
+// This function may ONLY be used during initialization,
+// before the buddy free lists have been set up.
+static void *
+boot_alloc(uint32_t n)
+{
+	static char *nextfree;	// virtual address of next byte of free memory
+	char *result;
+
+	// Initialize nextfree if this is the first time.
+	// 'end' is a magic symbol automatically generated by the linker,
+	// which points to the end of the kernel's bss segment:
+	// the first virtual address that the linker did *not* assign
+	// to any kernel code or global variables.
+	if (!nextfree) {
+		extern char end[];
+		nextfree = ROUNDUP((char *) end, PGSIZE);
+	}
+
+	result = nextfree;
+	nextfree = ROUNDUP(nextfree + n, PGSIZE);
+	if (PADDR(nextfree) > direct_map_top)
+		panic("boot_alloc: out of memory allocating %u bytes", n);
+	return result;
+}
+
+// Detect how much physical memory the machine has, set up the page
+// allocator over it, and check that it works.
+void
+mem_init(void)
+{
+	uint32_t edx;
+
+	// Find out how much memory the machine has (npages).
+	i386_detect_memory();
+
+	//////////////////////////////////////////////////////////////////////
+	// create initial page directory.
+	kern_pgdir = (pde_t *) boot_alloc(PGSIZE);
+	memset(kern_pgdir, 0, PGSIZE);
+
+	//////////////////////////////////////////////////////////////////////
+	// Allocate an array of npages 'struct PageInfo's and store it in
+	// 'pages'.  The kernel uses this array to keep track of physical
+	// pages: for each physical page, there is a corresponding struct
+	// PageInfo in this array.
+	pages = boot_alloc(npages * sizeof(struct PageInfo));
+	memset(pages, 0, npages * sizeof(struct PageInfo));
+
+	//////////////////////////////////////////////////////////////////////
+	// Now that we've allocated the initial kernel data structures, we set
+	// up the list of free physical pages.  Once we've done so, all
+	// further memory management will go through the page_* functions.
+	page_init();
+
+	check_buddy();
+
+	//////////////////////////////////////////////////////////////////////
+	// Map all of physical memory at KERNBASE.  These mappings are the
+	// same in every address space, so mark them global if the CPU
+	// allows, and CR3 reloads will no longer flush them from the TLB.
+	// With 4MB pages, map the whole window from KERNBASE to 4GB: it
+	// needs no page tables and only a few TLB entries.  The first 4MB
+	// still gets 4KB pages, so that the display memory in the I/O hole
+	// can have a memory type of its own (see direct_map_wc()).
+	// Without PSE, map just the RAM, with page tables that have to
+	// come from the memory entry_pgdir maps.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_EDX_PGE)
+		pte_global = PTE_G;
+	if (edx & CPUID_EDX_PSE) {
+		lcr4(rcr4() | CR4_PSE);
+		boot_map_region(kern_pgdir, KERNBASE, PTSIZE, 0,
+				PTE_W | pte_global);
+		boot_map_region(kern_pgdir, KERNBASE + PTSIZE,
+				DIRECT_MAP_MAX - PTSIZE, PTSIZE,
+				PTE_PS | PTE_W | pte_global);
+	} else
+		boot_map_region(kern_pgdir, KERNBASE, npages * PGSIZE, 0,
+				PTE_W | pte_global);
+
+	// Map the per-CPU kernel stacks that traps switch to, each below
+	// its own unmapped guard gap.
+	mem_init_mp();
+
+	// Switch from the minimal entry page directory to the full
+	// kern_pgdir page table we just created.
+	lcr3(PADDR(kern_pgdir));
+	if (pte_global)
+		lcr4(rcr4() | CR4_PGE);
+
+	// All of RAM is reachable now: free the rest of it.
+	page_free_ranges(direct_map_top, npages * PGSIZE);
+	direct_map_top = npages * PGSIZE;
+
+	pat_init();
+
+	check_kern_pgdir();
+}
+
+// Switch an AP from entry_pgdir to kern_pgdir, with the same paging
+// features mem_init() turned on for the BSP.
+void
+mem_init_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_EDX_PSE)
+		lcr4(rcr4() | CR4_PSE);
+	lcr3(PADDR(kern_pgdir));
+	if (pte_global)
+		lcr4(rcr4() | CR4_PGE);
+	pat_init();
+}
+
+
+// Map the kernel stacks for each CPU at
+// [KSTACKTOP - i * (KSTKSIZE + KSTKGAP) - KSTKSIZE,
+//  KSTACKTOP - i * (KSTKSIZE + KSTKGAP)), backed by percpu_kstacks[i].
+// The KSTKGAP below each stack is left unmapped, so an overflow faults
+// rather than overwriting the next CPU's stack.
+static void
+mem_init_mp(void)
+{
+	uintptr_t kstacktop;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		kstacktop = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+		boot_map_region(kern_pgdir, kstacktop - KSTKSIZE, KSTKSIZE,
+				PADDR(percpu_kstacks[i]), PTE_W | pte_global);
+	}
+}
+
+
+// --------------------------------------------------------------
+// Tracking of physical pages.
+// The 'pages' array has one 'struct PageInfo' entry per physical page.
+// Free pages are kept on buddy free lists, by block size.
+// --------------------------------------------------------------
+
+static void
+free_area_push(struct PageInfo *pp, int order)
+{
+	struct Free_area *fa = &free_area[order];
+
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	pp->pp_prev = NULL;
+	pp->pp_link = fa->fa_head;
+	if (fa->fa_head)
+		fa->fa_head->pp_prev = pp;
+	fa->fa_head = pp;
+	fa->fa_nfree++;
+}
+
+static void
+free_area_remove(struct PageInfo *pp)
+{
+	struct Free_area *fa = &free_area[pp->pp_order];
+
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		fa->fa_head = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
+	pp->pp_flags &= ~PP_FREE;
+	fa->fa_nfree--;
+}
+
+// Free the pages [start, end) (page numbers), as the largest naturally
+// aligned blocks that fit.
+static void
+page_free_range(size_t start, size_t end)
+{
+	int order;
+
+	while (start < end) {
+		for (order = BUDDY_MAXORDER; order > 0; order--)
+			if (start % (1 << order) == 0
+			    && start + (1 << order) <= end)
+				break;
+		pages[start].pp_order = order;
+		page_free(&pages[start]);
+		start += 1 << order;
+	}
+}
+
+//
+// Initialize page structure and memory free lists.
+// After this is done, NEVER use boot_alloc again.  ONLY use the page
+// allocator functions below to allocate and deallocate physical
+// memory via the buddy free lists.
+//
+void
+page_init(void)
+{
+	// Free every page of RAM except:
+	//  1) Physical page 0, which holds the real-mode IDT and BIOS
+	//     structures, in case we ever need them.
+	//  2) The kernel and what boot_alloc() has handed out, which
+	//     start at EXTPHYSMEM.
+	//  3) Anything at or above direct_map_top, which we can't reach
+	//     yet.  mem_init() frees it once it is mapped.
+	// The I/O hole [IOPHYSMEM, EXTPHYSMEM) is not in mem_ranges.
+	page_free_ranges(0, direct_map_top);
+}
+
+// Free the RAM in [lo, hi) (physical addresses), leaving out the pages
+// page_init() must keep.
+static void
+page_free_ranges(physaddr_t lo, physaddr_t hi)
+{
+	physaddr_t kern_end = PADDR(boot_alloc(0)), start, end;
+	int i;
+
+	for (i = 0; i < nmem_ranges; i++) {
+		start = ROUNDUP(MAX(mem_ranges[i].mr_start, lo), PGSIZE);
+		end = ROUNDDOWN(MIN(mem_ranges[i].mr_end, hi), PGSIZE);
+		if (start < PGSIZE)
+			start = PGSIZE;
+		// The APs start running at MPENTRY_PADDR.
+		if (start <= MPENTRY_PADDR && end > MPENTRY_PADDR) {
+			page_free_range(PGNUM(start), PGNUM(MPENTRY_PADDR));
+			start = MPENTRY_PADDR + PGSIZE;
+		}
+		if (start < kern_end && end > EXTPHYSMEM) {
+			if (start < EXTPHYSMEM)
+				page_free_range(PGNUM(start), PGNUM(EXTPHYSMEM));
+			start = kern_end;
+		}
+		if (start < end)
+			page_free_range(PGNUM(start), PGNUM(end));
+	}
+}
+
+//
+// Allocates a block of 2^order physical pages, aligned to its size.
+// If (alloc_flags & ALLOC_ZERO), fills the entire block with '\0' bytes.
+// Does NOT increment the reference count of the page - the caller must do
+// these if necessary (either explicitly or via page_insert).
+//
+// Takes the smallest free block that is big enough, splitting it in half
+// as many times as needed and freeing the unused halves: O(BUDDY_MAXORDER).
+//
+// Returns NULL if out of free memory.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int k;
+
+	if (order < 0 || order > BUDDY_MAXORDER)
+		return NULL;
+	for (k = order; k <= BUDDY_MAXORDER && !free_area[k].fa_head; k++)
+		/* do nothing */;
+	if (k > BUDDY_MAXORDER)
+		return NULL;
+
+	pp = free_area[k].fa_head;
+	free_area_remove(pp);
+	while (k > order) {
+		k--;
+		free_area_push(pp + (1 << k), k);
+	}
+	pp->pp_order = order;
+
+	if (alloc_flags & ALLOC_ZERO)
+		bulk_zero(page2kva(pp), PGSIZE << order);
+	return pp;
+}
+
+//
+// Allocates a single physical page; see page_alloc_order.
+//
+struct PageInfo *
+page_alloc(int alloc_flags)
+{
+	return page_alloc_order(0, alloc_flags);
+}
+
+//
+// Return a block of pages, as allocated by page_alloc_order, to the
+// free lists.  While the block's buddy (the other half of the block
+// twice its size) is also free, the two merge.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct PageInfo *pp)
+{
+	size_t i = pp - pages, b;
+	int order = pp->pp_order;
+
+	if (pp->pp_ref != 0 || pp->pp_link != NULL || (pp->pp_flags & PP_FREE))
+		panic("page_free: page %08x is still in use", page2pa(pp));
+
+	for (; order < BUDDY_MAXORDER; order++) {
+		b = i ^ (1 << order);
+		if (b >= npages || !(pages[b].pp_flags & PP_FREE)
+		    || pages[b].pp_order != order)
+			break;
+		free_area_remove(&pages[b]);
+		i &= ~(1 << order);
+	}
+	free_area_push(&pages[i], order);
+}
+
+//
+// Decrement the reference count on a page,
+// freeing it if there are no more refs.
+//
+void
+page_decref(struct PageInfo* pp)
+{
+	if (--pp->pp_ref == 0)
+		page_free(pp);
+}
+
+// Number of free pages, over all block sizes.
+size_t
+page_nfree(void)
+{
+	size_t n = 0;
+	int k;
+
+	for (k = 0; k <= BUDDY_MAXORDER; k++)
+		n += free_area[k].fa_nfree << k;
+	return n;
+}
+
+void
+page_print_buddyinfo(void)
+{
+	int k;
+
+	cprintf("order ");
+	for (k = 0; k <= BUDDY_MAXORDER; k++)
+		cprintf(" %5d", k);
+	cprintf("\nfree  ");
+	for (k = 0; k <= BUDDY_MAXORDER; k++)
+		cprintf(" %5u", free_area[k].fa_nfree);
+	cprintf("\n%u of %u pages free (%uK)\n", page_nfree(), npages,
+		page_nfree() * (PGSIZE / 1024));
+}
+
+//
+// Given 'pgdir', a pointer to a page directory, pgdir_walk returns
+// a pointer to the page table entry (PTE) for linear address 'va'.
+// If the relevant page table page doesn't exist, it is allocated
+// when 'create' is true; otherwise pgdir_walk returns NULL, as it
+// does if the allocation fails.
+// If 'va' is in a 4MB page, it returns the page directory entry, which
+// holds the same flags in the same places.
+//
+pte_t *
+pgdir_walk(pde_t *pgdir, const void *va, int create)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct PageInfo *pp;
+
+	if (*pde & PTE_PS)
+		return (pte_t *) pde;
+	if (!(*pde & PTE_P)) {
+		if (!create || !(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		pp->pp_ref++;
+		*pde = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+	}
+	return (pte_t *) KADDR(PTE_ADDR(*pde)) + PTX(va);
+}
+
+//
+// Map [va, va+size) of virtual address space to physical [pa, pa+size)
+// in the page table rooted at pgdir.  Size is a multiple of PGSIZE, and
+// va and pa are both page-aligned.
+// Use permission bits perm|PTE_P for the entries.
+// If perm includes PTE_PS, map with 4MB pages instead: size, va and pa
+// must then be multiples of PTSIZE, and CR4.PSE must be on.
+//
+// This function is only intended to set up the ``static'' mappings
+// above UTOP.
+//
+static void
+boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	size_t off;
+	pte_t *pte;
+
+	if (perm & PTE_PS) {
+		for (off = 0; off < size; off += PTSIZE)
+			pgdir[PDX(va + off)] = (pa + off) | perm | PTE_P;
+		return;
+	}
+	for (off = 0; off < size; off += PGSIZE) {
+		if (!(pte = pgdir_walk(pgdir, (void *) (va + off), 1)))
+			panic("boot_map_region: out of memory at %08x", va + off);
+		*pte = (pa + off) | perm | PTE_P;
+	}
+}
+
+//
+// Program the Page Attribute Table like the power-on default (entry
+// 0 write-back, 2 weakly uncached, 3 uncached, and the upper four the
+// same with 5 write-through) except that entry 1, which PTE_PWT alone
+// selects, is write-combining instead of write-through.  Nothing maps
+// memory with PTE_PWT alone yet, so there are no stale TLB entries to
+// flush.
+//
+static void
+pat_init(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_EDX_PAT))
+		return;
+	wrmsr(MSR_IA32_PAT,
+	      PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WC)
+	      | PAT_ENTRY(2, PAT_UC_MINUS) | PAT_ENTRY(3, PAT_UC)
+	      | PAT_ENTRY(4, PAT_WB) | PAT_ENTRY(5, PAT_WT)
+	      | PAT_ENTRY(6, PAT_UC_MINUS) | PAT_ENTRY(7, PAT_UC));
+	pte_wc = PTE_PWT;
+}
+
+//
+// Reserve size bytes in the MMIO region and map [pa,pa+size) at this
+// location with the cache bits in 'cache'.  Return the base of the
+// reserved region.  size does *not* have to be a multiple of PGSIZE,
+// nor pa page-aligned; the result points at pa itself.
+//
+static void *
+mmio_map(physaddr_t pa, size_t size, uint32_t cache)
+{
+	// Where to start the next region.  Initially, this is the
+	// beginning of the MMIO region.  Because this is static, its
+	// value will be preserved between calls to mmio_map.
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va = base;
+
+	size = ROUNDUP(pa + size, PGSIZE) - ROUNDDOWN(pa, PGSIZE);
+	if (size > MMIOLIM - base)
+		panic("mmio_map: %u bytes at %08x overflow MMIOLIM", size, pa);
+	boot_map_region(kern_pgdir, base, size, ROUNDDOWN(pa, PGSIZE),
+			PTE_W | cache | pte_global);
+	base += size;
+	return (void *) (va + PGOFF(pa));
+}
+
+// Map device registers: uncached, so every access reaches the device
+// in order.
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	return mmio_map(pa, size, PTE_PCD | PTE_PWT);
+}
+
+// Make a framebuffer in the first 4MB of physical memory
+// write-combining where the CPU has a PAT, so consecutive writes go out
+// as bursts.  Reads are uncached and slow; keep a copy in RAM rather
+// than reading the framebuffer back.
+//
+// This changes the direct map at KERNBASE rather than mapping the
+// pages a second time: the results of mapping one page with two memory
+// types are undefined.  mem_init() maps the first 4MB with 4KB pages so
+// that this can be done page by page.
+void
+direct_map_wc(physaddr_t pa, size_t size)
+{
+	uintptr_t va, end;
+
+	assert(pa + size <= PTSIZE);
+	if (!pte_wc)
+		return;
+	va = ROUNDDOWN((uintptr_t) KADDR(pa), PGSIZE);
+	end = ROUNDUP((uintptr_t) KADDR(pa) + size, PGSIZE);
+	for (; va < end; va += PGSIZE) {
+		*pgdir_walk(kern_pgdir, (void *) va, 0) |= pte_wc;
+		invlpg((void *) va);
+	}
+	// Lines cached while the pages were write-back must not linger.
+	wbinvd();
+}
+
+//
+// Measure what global pages save on an address space switch: reload
+// CR3 'nswitch' times, touching a 64-page kernel buffer after each,
+// once with the kernel's mappings global and once with CR4.PGE off.
+//
+// A TLB miss makes the MMU walk the page table, which sets PTE_A in
+// the entry it loads.  Clearing PTE_A without invalidating anything
+// and counting how many entries have it again after the next switch
+// counts the buffer's TLB misses exactly, as long as each page has an
+// entry of its own.  The direct map at KERNBASE uses 4MB pages where
+// the CPU has PSE, which would put the whole buffer behind one page
+// directory entry, so the buffer is measured through a window of 4KB
+// mappings in the MMIO region instead.
+//
+#define TLBSTAT_ORDER	6
+#define TLBSTAT_SIZE	((1 << TLBSTAT_ORDER) * PGSIZE)
+
+static void
+tlb_measure(char *buf, int nswitch, uint64_t *misses, uint64_t *cycles)
+{
+	pte_t *ptes[1 << TLBSTAT_ORDER];
+	uint64_t t0;
+	int i, j;
+
+	for (j = 0; j < (1 << TLBSTAT_ORDER); j++)
+		ptes[j] = pgdir_walk(kern_pgdir, buf + j * PGSIZE, 0);
+
+	*misses = *cycles = 0;
+	for (i = -1; i < nswitch; i++) {
+		// The first round just loads the buffer into the TLB.
+		t0 = read_tsc();
+		lcr3(PADDR(kern_pgdir));
+		for (j = 0; j < (1 << TLBSTAT_ORDER); j++)
+			((volatile char *) buf)[j * PGSIZE];
+		if (i >= 0)
+			*cycles += read_tsc() - t0;
+
+		for (j = 0; j < (1 << TLBSTAT_ORDER); j++) {
+			if (i >= 0 && (*ptes[j] & PTE_A))
+				++*misses;
+			*ptes[j] &= ~PTE_A;
+		}
+	}
+}
+
+// Map the window at 'va' onto the pages at 'pa', or unmap it if 'pa'
+// is 0.  The window's page tables exist once mmio_map() has made it.
+static void
+tlb_window_map(char *va, physaddr_t pa)
+{
+	pte_t *pte;
+	int j;
+
+	for (j = 0; j < (1 << TLBSTAT_ORDER); j++) {
+		pte = pgdir_walk(kern_pgdir, va + j * PGSIZE, 0);
+		*pte = pa ? (pa + j * PGSIZE) | PTE_W | pte_global | PTE_P : 0;
+		invlpg(va + j * PGSIZE);
+	}
+}
+
+void
+tlb_print_stats(int nswitch)
+{
+	// Reserved on first use, and unmapped whenever tlbstat is not
+	// running, so it never outlives the pages behind it.
+	static char *window;
+	struct PageInfo *pp;
+	uint64_t misses, cycles;
+	uint32_t cr4 = rcr4();
+
+	if (nswitch <= 0)
+		return;
+	if (!(pp = page_alloc_order(TLBSTAT_ORDER, 0))) {
+		cprintf("tlbstat: out of memory\n");
+		return;
+	}
+	// Write-back, like the same pages in the direct map.
+	if (!window)
+		window = mmio_map(page2pa(pp), TLBSTAT_SIZE, 0);
+	else
+		tlb_window_map(window, page2pa(pp));
+
+	cprintf("%d CR3 reloads, each followed by a touch of %d pages\n",
+		nswitch, 1 << TLBSTAT_ORDER);
+	cprintf("                misses/switch  cycles/switch\n");
+	if (cr4 & CR4_PGE) {
+		tlb_measure(window, nswitch, &misses, &cycles);
+		cprintf("global         %10llu.%02llu %14llu\n",
+			misses / nswitch, misses * 100 / nswitch % 100,
+			cycles / nswitch);
+		lcr4(cr4 & ~CR4_PGE);
+	} else
+		cprintf("global         (not supported by this CPU)\n");
+	tlb_measure(window, nswitch, &misses, &cycles);
+	cprintf("not global     %10llu.%02llu %14llu\n",
+		misses / nswitch, misses * 100 / nswitch % 100,
+		cycles / nswitch);
+	lcr4(cr4);
+
+	tlb_window_map(window, 0);
+	page_free(pp);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+//
+// Check the buddy allocator: alignment, splitting, coalescing and
+// ALLOC_ZERO.
+//
+static void
+check_buddy(void)
+{
+	struct PageInfo *pp, *pp0, *pp1, *blocks[BUDDY_MAXORDER + 1];
+	size_t nfree = page_nfree(), nfree_k[BUDDY_MAXORDER + 1], n;
+	uint32_t *p;
+	int k;
+
+	for (k = 0; k <= BUDDY_MAXORDER; k++) {
+		nfree_k[k] = free_area[k].fa_nfree;
+		for (pp = free_area[k].fa_head, n = 0; pp; pp = pp->pp_link, n++) {
+			assert(pp->pp_flags & PP_FREE);
+			assert(pp->pp_order == k);
+			assert((pp - pages) % (1 << k) == 0);
+			assert(page2pa(pp) + (PGSIZE << k) <= direct_map_top);
+			// Nothing free may overlap the kernel or boot_alloc().
+			assert(page2pa(pp) + (PGSIZE << k) <= EXTPHYSMEM
+			       || page2pa(pp) >= PADDR(boot_alloc(0)));
+			assert(page2pa(pp) != 0);
+		}
+		assert(n == free_area[k].fa_nfree);
+	}
+	assert(nfree > 0);
+
+	// One block of each order, aligned to its size and not
+	// overlapping any other.
+	for (k = 0; k <= BUDDY_MAXORDER; k++) {
+		blocks[k] = page_alloc_order(k, 0);
+		if (!blocks[k])
+			continue;
+		assert(blocks[k]->pp_order == k);
+		assert(!(blocks[k]->pp_flags & PP_FREE));
+		assert(page2pa(blocks[k]) % (PGSIZE << k) == 0);
+		for (n = 0; n < k; n++)
+			assert(!blocks[n]
+			       || page2pa(blocks[n]) + (PGSIZE << n)
+				  <= page2pa(blocks[k])
+			       || page2pa(blocks[k]) + (PGSIZE << k)
+				  <= page2pa(blocks[n]));
+	}
+	assert(page_alloc_order(BUDDY_MAXORDER + 1, 0) == NULL);
+
+	// ALLOC_ZERO clears the whole block.
+	assert(blocks[2]);
+	memset(page2kva(blocks[2]), 0xa5, PGSIZE << 2);
+	page_free(blocks[2]);
+	blocks[2] = page_alloc_order(2, ALLOC_ZERO);
+	for (p = page2kva(blocks[2]), n = 0; n < (PGSIZE << 2) / 4; n++)
+		assert(p[n] == 0);
+
+	// Freeing everything merges back to exactly the blocks we started
+	// with.
+	for (k = 0; k <= BUDDY_MAXORDER; k++)
+		if (blocks[k])
+			page_free(blocks[k]);
+	assert(page_nfree() == nfree);
+	for (k = 0; k <= BUDDY_MAXORDER; k++)
+		assert(free_area[k].fa_nfree == nfree_k[k]);
+
+	// Exhaust memory one page at a time, then give it all back.
+	pp0 = NULL;
+	while ((pp = page_alloc(0))) {
+		pp->pp_link = pp0;
+		pp0 = pp;
+	}
+	assert(page_nfree() == 0);
+	assert(page_alloc_order(0, 0) == NULL);
+	for (pp = pp0; pp; pp = pp1) {
+		pp1 = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+	assert(page_nfree() == nfree);
+	for (k = 0; k <= BUDDY_MAXORDER; k++)
+		assert(free_area[k].fa_nfree == nfree_k[k]);
+
+	cprintf("check_buddy() succeeded!\n");
+}
+
+// This function returns the physical address of the page containing 'va',
+// defined by the page directory 'pgdir'.  The hardware normally performs
+// this functionality for us!  We define our own version to help check
+// the check_kern_pgdir() function; it shouldn't be used elsewhere.
+static physaddr_t
+check_va2pa(pde_t *pgdir, uintptr_t va)
+{
+	pte_t *p;
+
+	pgdir = &pgdir[PDX(va)];
+	if (!(*pgdir & PTE_P))
+		return ~0;
+	if (*pgdir & PTE_PS)
+		return PTE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
+	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
+	if (!(p[PTX(va)] & PTE_P))
+		return ~0;
+	return PTE_ADDR(p[PTX(va)]);
+}
+
+//
+// Check that the kernel part of virtual address space
+// has been set up properly by mem_init().
+//
+static void
+check_kern_pgdir(void)
+{
+	uint32_t i, n;
+
+	// check phys mem
+	assert(direct_map_top == npages * PGSIZE);
+	for (i = 0; i < direct_map_top; i += PGSIZE) {
+		assert(check_va2pa(kern_pgdir, KERNBASE + i) == i);
+		assert((*pgdir_walk(kern_pgdir, (void *) (KERNBASE + i), 0)
+			& (PTE_W | PTE_G)) == (PTE_W | pte_global));
+	}
+
+	// with 4MB pages, the whole window up to 4GB, and no page tables
+	// past the first 4MB
+	if (rcr4() & CR4_PSE) {
+		assert(!(kern_pgdir[PDX(KERNBASE)] & PTE_PS));
+		for (i = PTSIZE; i < DIRECT_MAP_MAX; i += PTSIZE) {
+			assert(kern_pgdir[PDX(KERNBASE + i)] & PTE_PS);
+			assert(check_va2pa(kern_pgdir, KERNBASE + i) == i);
+		}
+	}
+
+	// check kernel stacks
+	for (n = 0; n < NCPU; n++) {
+		uint32_t base = KSTACKTOP - (KSTKSIZE + KSTKGAP) * (n + 1);
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(kern_pgdir, base + KSTKGAP + i)
+				== PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(kern_pgdir, base + i) == ~0);
+	}
+
+	// nothing else below KERNBASE, the entry.S identity map included
+	for (i = 0; i < PDX(KERNBASE); i++)
+		assert(kern_pgdir[i] == 0 || i == PDX(KSTACKTOP - 1));
+
+	// global pages are on exactly when the CPU supports them
+	assert(!!(rcr4() & CR4_PGE) == !!pte_global);
+
+	cprintf("check_kern_pgdir() succeeded!\n");
+}
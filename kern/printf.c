@@ -5,6 +5,17 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
+// Keeps lines from different CPUs apart.  Most callers hold the big
+// kernel lock anyway, but an AP announces itself before taking it, and
+// a CPU that panics must be able to print whatever the others are
+// doing.
+static struct spinlock cons_lock = {
+	.name = "cons_lock"
+};
+
+extern const char *panicstr;
 
 static void
 putch(int ch, int *cnt)
@@ -17,8 +28,15 @@ int
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
+	// After a panic, print regardless: the lock may be held by a
+	// CPU that will never let go, or by this one.
+	bool locking = !panicstr;
 
+	if (locking)
+		spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locking)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
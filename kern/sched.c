@@ -0,0 +1,573 @@
+// Scheduling of kernel tasks.
+//
+// Each CPU has a run queue per priority level, and a bitmap records
+// which of them may be non-empty, so picking the next task is a bsf and
+// a dequeue: O(1) however many tasks there are.  Tasks run until they
+// yield, sleep or return; then they switch back to their CPU's
+// scheduler loop, which picks the next.  A task that becomes ready goes
+// on the run queue of the CPU that readied it.  A CPU with nothing of
+// its own to run steals from the others, starting at a random one, and
+// kicks an idle CPU awake whenever it queues a task, so that one can
+// steal it.
+//
+// A run queue is a Chase-Lev work-stealing deque: only its CPU pushes,
+// at the bottom, and takers race for the top with cmpxchg, so neither
+// needs a lock.  Unlike Chase-Lev, the owner takes from the top too:
+// popping its own bottom would let a task that yields straight back in.
+// A task goes on a run queue only once it is off its stack: a yielding
+// task is queued by sched_once() after sched_switch() has saved its
+// t_esp, so a thief can never resume it half-saved.  So the run queues
+// do not rely on the big kernel lock, though the rest of the scheduler
+// (sched_idle_cpus, the statistics) still does.
+//
+// A strict priority order would starve low-priority work for as long as
+// anything above it stays runnable.  So every SCHED_AGE_NS, each CPU
+// moves each of its run queues up a level; a task goes back to its own
+// level the next time it is queued.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/trap.h>
+
+#include <kern/sched.h>
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/spinlock.h>
+
+// A task is on at most one run queue, so none can overflow.
+#define RUNQ_SIZE	SCHED_MAXTASKS
+
+struct Runq {
+	volatile uint32_t rq_top;	// Next to take
+	volatile uint32_t rq_bottom;	// Next free slot
+	struct Task *rq_task[RUNQ_SIZE];
+};
+
+// Per-CPU scheduler state
+struct Sched_cpu {
+	struct Runq sc_runq[NPRIO];
+	volatile uint32_t sc_bitmap;	// Bit p set if sc_runq[p] may have tasks
+	uint64_t sc_next_age;		// When to age the run queues next
+	uint32_t sc_rand;		// State of the victim picker
+
+	// Statistics
+	uint64_t sc_ndispatch;		// Tasks dispatched
+	uint64_t sc_nsteal;		// ... of which taken from another CPU
+	uint64_t sc_nmigrate;		// ... that last ran on another CPU
+	uint64_t sc_idle_cycles;	// Time with nothing to run
+};
+
+static struct Sched_cpu sched_cpus[NCPU];
+
+static struct Kmem_cache *task_cache;
+static int sched_ntasks;		// Tasks not yet freed
+static uint32_t sched_idle_cpus;	// Bit i set if cpus[i] waits for work
+
+// Statistics
+static uint64_t sched_pick_cycles;	// Cycles spent picking tasks
+static uint64_t sched_nage;		// Run queues moved up a level
+static uint64_t sched_hist[SCHED_NHIST];	// Dispatch latency
+
+void sched_switch(uint32_t **save_esp, uint32_t *esp);
+
+// Add t at the bottom of rq.  Only rq's CPU may call this.
+static void
+runq_push(struct Runq *rq, struct Task *t)
+{
+	uint32_t bottom = rq->rq_bottom;
+
+	assert(bottom - rq->rq_top < RUNQ_SIZE);
+	rq->rq_task[bottom % RUNQ_SIZE] = t;
+	// Publish the task only once it is stored.  x86 keeps stores in
+	// order; this keeps the compiler from reordering them.
+	asm volatile("" : : : "memory");
+	rq->rq_bottom = bottom + 1;
+}
+
+// Take the task at the top of rq, or return NULL if it is empty.  Any
+// CPU may call this.
+static struct Task *
+runq_take(struct Runq *rq)
+{
+	uint32_t top;
+	struct Task *t;
+
+	do {
+		top = rq->rq_top;
+		if ((int32_t) (rq->rq_bottom - top) <= 0)
+			return NULL;
+		// Read the slot only after seeing rq_bottom past it: the
+		// pair to the barrier in runq_push().
+		asm volatile("" : : : "memory");
+		t = rq->rq_task[top % RUNQ_SIZE];
+		// The owner cannot reuse the slot until rq_top moves past
+		// it, so if the cmpxchg succeeds, t is still the task.
+	} while (cmpxchg(&rq->rq_top, top, top + 1) != top);
+	return t;
+}
+
+// Wake one of the other CPUs waiting for work, if any; or, if 'all',
+// every one.
+static void
+sched_kick(bool all)
+{
+	uint32_t idle;
+	int i;
+
+	while ((idle = sched_idle_cpus & ~(1U << cpunum()))) {
+		i = bsf(idle);
+		sched_idle_cpus &= ~(1U << i);
+		lapic_ipi(cpus[i].cpu_apicid, IRQ_OFFSET + IRQ_WAKEUP);
+		if (!all)
+			break;
+	}
+}
+
+// Make t runnable, at its own priority, on this CPU.
+static void
+sched_ready(struct Task *t)
+{
+	struct Sched_cpu *sc = &sched_cpus[cpunum()];
+
+	t->t_state = TASK_RUNNABLE;
+	t->t_ready = ktime_get();
+	runq_push(&sc->sc_runq[t->t_prio], t);
+	sc->sc_bitmap |= 1U << t->t_prio;
+	sched_kick(0);
+}
+
+// Take the first task off this CPU's highest-priority non-empty run
+// queue.  Other CPUs may have emptied queues whose bit is still set;
+// only this CPU clears bits, and only it sets them, so they can't be
+// set again meanwhile.
+static struct Task *
+sched_pick(struct Sched_cpu *sc)
+{
+	struct Task *t;
+	int prio;
+
+	while (sc->sc_bitmap) {
+		prio = bsf(sc->sc_bitmap);
+		if ((t = runq_take(&sc->sc_runq[prio])))
+			return t;
+		sc->sc_bitmap &= ~(1U << prio);
+	}
+	return NULL;
+}
+
+// xorshift32: plenty random enough to spread thieves over victims.
+static uint32_t
+sched_rand(struct Sched_cpu *sc)
+{
+	uint32_t x = sc->sc_rand;
+
+	if (!x)
+		x = (uint32_t) read_tsc() | 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return sc->sc_rand = x;
+}
+
+// Take a task from another CPU's highest-priority non-empty run queue,
+// trying the CPUs in turn from a random one, so that thieves don't all
+// pile onto the same victim.
+static struct Task *
+sched_steal(struct Sched_cpu *sc)
+{
+	struct Sched_cpu *victim;
+	struct Task *t;
+	uint32_t bitmap;
+	int start, i, prio;
+
+	if (ncpu == 1)
+		return NULL;
+	start = sched_rand(sc) % ncpu;
+	for (i = 0; i < ncpu; i++) {
+		victim = &sched_cpus[(start + i) % ncpu];
+		if (victim == sc)
+			continue;
+		for (bitmap = victim->sc_bitmap; bitmap;
+		     bitmap &= ~(1U << prio)) {
+			prio = bsf(bitmap);
+			if ((t = runq_take(&victim->sc_runq[prio]))) {
+				sc->sc_nsteal++;
+				return t;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Move each of this CPU's run queues up a level, appending it to the
+// one above.  Working down from level 1 moves every task exactly one
+// level.
+static void
+sched_age(struct Sched_cpu *sc)
+{
+	struct Task *t;
+	int prio;
+
+	for (prio = 1; prio < NPRIO; prio++) {
+		if (!(sc->sc_bitmap & (1U << prio)))
+			continue;
+		while ((t = runq_take(&sc->sc_runq[prio]))) {
+			runq_push(&sc->sc_runq[prio - 1], t);
+			sc->sc_bitmap |= 1U << (prio - 1);
+		}
+		sc->sc_bitmap &= ~(1U << prio);
+		sched_nage++;
+	}
+}
+
+// Where a task starts, on its new stack.
+static void
+task_entry(void)
+{
+	curtask->t_func(curtask->t_arg);
+	curtask->t_state = TASK_DEAD;
+	sched_switch(&curtask->t_esp, thiscpu->cpu_sched_esp);
+	panic("dead task %s ran again", curtask->t_name);
+}
+
+// Create a task that will run func(arg) at priority 'prio', once
+// sched_run() runs.  Returns NULL if out of memory.
+struct Task *
+task_create(const char *name, int prio, void (*func)(void *), void *arg)
+{
+	struct Task *t;
+	uint32_t *esp;
+
+	assert(prio >= 0 && prio < NPRIO);
+	if (sched_ntasks >= SCHED_MAXTASKS)
+		return NULL;
+	if (!task_cache
+	    && !(task_cache = kmem_cache_create("task", sizeof(struct Task),
+						__alignof__(struct Task),
+						NULL)))
+		return NULL;
+	if (!(t = kmem_cache_alloc(task_cache)))
+		return NULL;
+	if (!(t->t_stack = page_alloc_order(TASK_STKORDER, 0))) {
+		kmem_cache_free(task_cache, t);
+		return NULL;
+	}
+
+	strncpy(t->t_name, name, TASK_NAMELEN - 1);
+	t->t_name[TASK_NAMELEN - 1] = 0;
+	t->t_prio = prio;
+	t->t_func = func;
+	t->t_arg = arg;
+	memset(&t->t_timer, 0, sizeof(t->t_timer));
+	fpu_state_init(&t->t_fpu);
+	t->t_cpu = cpunum();
+	t->t_nrun = 0;
+	t->t_wait_max = 0;
+
+	// The frame sched_switch() pops: callee-saved registers, with
+	// %ebp 0 to end backtraces, then task_entry's return address,
+	// and a null one for task_entry itself.
+	esp = (uint32_t *) ((char *) page2kva(t->t_stack)
+			    + (PGSIZE << TASK_STKORDER));
+	*--esp = 0;
+	*--esp = (uint32_t) task_entry;
+	*--esp = 0;			// %ebp
+	*--esp = 0;			// %ebx
+	*--esp = 0;			// %esi
+	*--esp = 0;			// %edi
+	t->t_esp = esp;
+
+	sched_ntasks++;
+	sched_ready(t);
+	return t;
+}
+
+// Give up the CPU to any other task that is ready, or higher priority.
+void
+sched_yield(void)
+{
+	assert(curtask);
+	curtask->t_state = TASK_YIELDING;
+	sched_switch(&curtask->t_esp, thiscpu->cpu_sched_esp);
+}
+
+static void
+sched_wakeup(struct Timer *tm)
+{
+	sched_ready(tm->tm_arg);
+}
+
+// Block the current task for 'ns' nanoseconds.
+void
+sched_sleep(uint64_t ns)
+{
+	assert(curtask);
+	curtask->t_state = TASK_SLEEPING;
+	timer_add(&curtask->t_timer, ktime_get() + ns, sched_wakeup, curtask);
+	sched_switch(&curtask->t_esp, thiscpu->cpu_sched_esp);
+}
+
+// Record that a task waited 'ns' to be dispatched.
+static void
+sched_hist_add(uint64_t ns)
+{
+	uint64_t us = ns / NSEC_PER_USEC;
+	int b = 0;
+
+	while (us && b < SCHED_NHIST - 1) {
+		us >>= 1;
+		b++;
+	}
+	sched_hist[b]++;
+}
+
+// Run one task until it gives up the CPU, or, if none is ready, wait
+// for something to happen.
+static void
+sched_once(void)
+{
+	struct Sched_cpu *sc = &sched_cpus[cpunum()];
+	struct Task *t;
+	uint64_t now, wait, t0;
+
+	// Tasks keep the CPU with interrupts off, so look for due timers
+	// here too, not just when idle.
+	timer_poll();
+	now = ktime_get();
+	if (now >= sc->sc_next_age) {
+		sched_age(sc);
+		sc->sc_next_age = now + SCHED_AGE_NS;
+	}
+
+	t0 = read_tsc();
+	if (!(t = sched_pick(sc)))
+		t = sched_steal(sc);
+	sched_pick_cycles += read_tsc() - t0;
+	if (!t) {
+		sched_idle_cpus |= 1U << cpunum();
+		t0 = read_tsc();
+		cpu_idle();
+		sc->sc_idle_cycles += read_tsc() - t0;
+		sched_idle_cpus &= ~(1U << cpunum());
+		return;
+	}
+
+	wait = ktime_get() - t->t_ready;
+	sched_hist_add(wait);
+	t->t_wait_max = MAX(t->t_wait_max, wait);
+	t->t_nrun++;
+	sc->sc_ndispatch++;
+	if (t->t_cpu != cpunum())
+		sc->sc_nmigrate++;
+	t->t_cpu = cpunum();
+
+	t->t_state = TASK_RUNNING;
+	this_cpu_write(cpu_task, t);
+	fpu_switch_in();
+	sched_switch(&thiscpu->cpu_sched_esp, t->t_esp);
+	fpu_switch_out(&t->t_fpu, t->t_state == TASK_DEAD);
+	this_cpu_write(cpu_task, NULL);
+
+	if (t->t_state == TASK_YIELDING)
+		sched_ready(t);
+	else if (t->t_state == TASK_DEAD) {
+		page_free(t->t_stack);
+		kmem_cache_free(task_cache, t);
+		// Let a CPU waiting in sched_run() see that all are done.
+		if (--sched_ntasks == 0)
+			sched_kick(1);
+	}
+}
+
+// Run tasks, on this CPU and any others that are free, until they have
+// all returned.
+void
+sched_run(void)
+{
+	assert(!curtask);
+	while (sched_ntasks)
+		sched_once();
+}
+
+// Run tasks for ever.  The APs end up here once they are started.
+void
+sched_ap(void)
+{
+	for (;;)
+		sched_once();
+}
+
+void
+sched_print_stats(void)
+{
+	struct Sched_cpu *sc;
+	uint64_t max = 0, ndispatch = 0;
+	int b, i;
+
+	for (i = 0; i < ncpu; i++)
+		ndispatch += sched_cpus[i].sc_ndispatch;
+	cprintf("%llu dispatches", ndispatch);
+	if (ndispatch)
+		cprintf(", %llu cycles per pick",
+			sched_pick_cycles / ndispatch);
+	cprintf(", %llu run queues aged\n", sched_nage);
+	cprintf("cpu  dispatches    steals  migrations   idle ms\n");
+	for (i = 0; i < ncpu; i++) {
+		sc = &sched_cpus[i];
+		cprintf("%3d  %10llu  %8llu  %10llu  %8llu\n", i,
+			sc->sc_ndispatch, sc->sc_nsteal, sc->sc_nmigrate,
+			tsc_to_ns(sc->sc_idle_cycles) / NSEC_PER_MSEC);
+	}
+
+	for (b = 0; b < SCHED_NHIST; b++)
+		max = MAX(max, sched_hist[b]);
+	if (!max)
+		return;
+	cprintf("dispatch latency:\n");
+	for (b = 0; b < SCHED_NHIST; b++) {
+		if (b == 0)
+			cprintf("        <1us");
+		else
+			cprintf("  %7uus+", 1U << (b - 1));
+		cprintf(" %8llu ", sched_hist[b]);
+		for (i = 0; i < (sched_hist[b] * 40 + max - 1) / max; i++)
+			cprintf("#");
+		cprintf("\n");
+	}
+}
+
+
+static void
+spin(uint64_t ns)
+{
+	uint64_t t0 = ktime_get();
+
+	while (ktime_get() - t0 < ns)
+		asm volatile("pause");
+}
+
+static void
+demo_report(void)
+{
+	cprintf("  %-12s prio %2d: %4u runs, waited at most %llu us, "
+		"done on CPU %d\n", curtask->t_name, curtask->t_prio,
+		curtask->t_nrun, curtask->t_wait_max / NSEC_PER_USEC,
+		cpunum());
+}
+
+// Sleeps a millisecond at a time and does a little work in between,
+// like a task waiting on a device or a user.
+static void
+demo_interactive(void *arg)
+{
+	int i;
+
+	for (i = 0; i < 50; i++) {
+		sched_sleep(NSEC_PER_MSEC);
+		spin(20 * NSEC_PER_USEC);
+	}
+	demo_report();
+}
+
+// Computes in slices of 200us, yielding in between.
+static void
+demo_compute(void *arg)
+{
+	int i;
+
+	for (i = 0; i < (int) arg; i++) {
+		spin(200 * NSEC_PER_USEC);
+		sched_yield();
+	}
+	demo_report();
+}
+
+// Run 'ntasks' each of interactive, CPU-bound and batch tasks, at high,
+// middle and lowest priority, and print how long each waited to run.
+// Without aging, the batch tasks would wait for all the CPU-bound ones
+// to finish.
+void
+sched_demo(int ntasks)
+{
+	int i;
+
+	for (i = 0; i < ntasks; i++)
+		if (!task_create("interactive", 0, demo_interactive, NULL)
+		    || !task_create("compute", NPRIO / 4, demo_compute,
+				    (void *) 250)
+		    || !task_create("batch", NPRIO - 1, demo_compute,
+				    (void *) 20)) {
+			cprintf("sched_demo: out of memory\n");
+			break;
+		}
+	sched_run();
+}
+
+// Work each task of the spawn benchmark does before spawning.
+#define SPAWN_WORK_NS	(20 * NSEC_PER_USEC)
+
+static int spawn_nfail;
+
+// Does a little work and then, unless 'arg' is 0, creates two tasks
+// one level shallower, the way a shell forks children that fork in
+// turn.  The children start on this CPU's run queue, so any other CPU
+// that runs them stole them.
+static void
+spawn_task(void *arg)
+{
+	int depth = (int) arg;
+	int i;
+
+	spin(SPAWN_WORK_NS);
+	if (depth == 0)
+		return;
+	for (i = 0; i < 2; i++)
+		if (!task_create("spawn", NPRIO / 2, spawn_task,
+				 (void *) (depth - 1)))
+			spawn_nfail++;
+}
+
+// Run a binary tree of 2^(depth+1) - 1 tasks, each created by its
+// parent, and print how long it took and how much work the CPUs took
+// from each other.
+void
+sched_spawn(int depth)
+{
+	uint64_t nsteal = 0, nmigrate = 0, ndispatch = 0, t0, ns;
+	uint32_t ntasks;
+	int i;
+
+	if (depth < 0 || (2U << depth) - 1 > SCHED_MAXTASKS) {
+		cprintf("sched_spawn: %u tasks at most\n", SCHED_MAXTASKS);
+		return;
+	}
+	for (i = 0; i < ncpu; i++) {
+		nsteal -= sched_cpus[i].sc_nsteal;
+		nmigrate -= sched_cpus[i].sc_nmigrate;
+		ndispatch -= sched_cpus[i].sc_ndispatch;
+	}
+	spawn_nfail = 0;
+
+	t0 = ktime_get();
+	if (!task_create("spawn", NPRIO / 2, spawn_task, (void *) depth)) {
+		cprintf("sched_spawn: out of memory\n");
+		return;
+	}
+	sched_run();
+	ns = ktime_get() - t0;
+
+	for (i = 0; i < ncpu; i++) {
+		nsteal += sched_cpus[i].sc_nsteal;
+		nmigrate += sched_cpus[i].sc_nmigrate;
+		ndispatch += sched_cpus[i].sc_ndispatch;
+	}
+	ntasks = (2U << depth) - 1 - spawn_nfail;
+	cprintf("%u tasks on %d CPUs in %llu us: %llu ns per task\n",
+		ntasks, ncpu, ns / NSEC_PER_USEC, ns / ntasks);
+	cprintf("%llu dispatches, %llu steals, %llu migrations\n",
+		ndispatch, nsteal, nmigrate);
+	if (spawn_nfail)
+		cprintf("%d tasks could not be created\n", spawn_nfail);
+}
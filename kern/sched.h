@@ -0,0 +1,67 @@
+#ifndef JOS_KERN_SCHED_H
+#define JOS_KERN_SCHED_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/cpu.h>
+#include <kern/fpu.h>
+
+#define NPRIO		32	// Priority levels; 0 is the highest
+#define TASK_NAMELEN	16	// Longest task name, with its null
+#define TASK_STKORDER	1	// Task stacks are 2^TASK_STKORDER pages
+#define SCHED_MAXTASKS	256	// Most tasks that can exist at once
+
+// A task waiting this long on a run queue moves up a priority level.
+#define SCHED_AGE_NS	(2 * NSEC_PER_MSEC)
+
+// Buckets of the scheduling latency histogram: under 1us, then one
+// per power of 2 us.
+#define SCHED_NHIST	16
+
+enum {
+	TASK_RUNNABLE = 0,	// On a run queue
+	TASK_RUNNING,
+	TASK_YIELDING,		// To be queued once it is off its stack
+	TASK_SLEEPING,		// Waiting for t_timer
+	TASK_DEAD,		// Returned; freed by the scheduler
+};
+
+// A kernel task: a function running on its own stack, which gives up
+// the CPU by calling sched_yield(), sched_sleep() or returning.
+struct Task {
+	uint32_t *t_esp;		// Saved stack pointer, when not running
+	struct PageInfo *t_stack;
+	char t_name[TASK_NAMELEN];
+	int t_prio;			// Base priority
+	int t_state;
+	void (*t_func)(void *);
+	void *t_arg;
+
+	uint64_t t_ready;		// When it last became runnable
+	struct Timer t_timer;		// For sched_sleep()
+	struct Fpu_state t_fpu;		// Saved by fpu_switch_out()
+	int t_cpu;			// CPU it last ran on
+
+	// Statistics
+	uint32_t t_nrun;		// Times dispatched
+	uint64_t t_wait_max;		// Longest wait to be dispatched
+};
+
+// The task running on this CPU; NULL in the scheduler itself
+#define curtask (this_cpu_read(cpu_task))
+
+struct Task *task_create(const char *name, int prio,
+			 void (*func)(void *), void *arg);
+void	sched_yield(void);
+void	sched_sleep(uint64_t ns);
+void	sched_run(void);
+void	sched_ap(void) __attribute__((noreturn));
+void	sched_print_stats(void);
+void	sched_demo(int ntasks);
+void	sched_spawn(int depth);
+
+#endif	// !JOS_KERN_SCHED_H
@@ -0,0 +1,58 @@
+#ifndef JOS_KERN_SEQLOCK_H
+#define JOS_KERN_SEQLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// A sequence lock, for data that is read often and written rarely.
+// Readers never block the writer or each other: they note the sequence
+// number, read, and try again if a write began or ended meanwhile.  The
+// number is odd while a write is in progress.  Writers must exclude
+// each other by some other means.
+//
+//	do {
+//		seq = seq_read_begin(&sq);
+//		... copy out the protected data ...
+//	} while (seq_read_retry(&sq, seq));
+//
+// x86 keeps loads in order with loads and stores with stores, so
+// compiler barriers are all the ordering needed.
+struct Seqlock {
+	volatile uint32_t sq_seq;
+};
+
+static inline uint32_t
+seq_read_begin(struct Seqlock *sq)
+{
+	uint32_t seq;
+
+	while ((seq = sq->sq_seq) & 1)
+		asm volatile("pause");
+	asm volatile("" : : : "memory");
+	return seq;
+}
+
+static inline bool
+seq_read_retry(struct Seqlock *sq, uint32_t seq)
+{
+	asm volatile("" : : : "memory");
+	return sq->sq_seq != seq;
+}
+
+static inline void
+seq_write_begin(struct Seqlock *sq)
+{
+	sq->sq_seq++;
+	asm volatile("" : : : "memory");
+}
+
+static inline void
+seq_write_end(struct Seqlock *sq)
+{
+	asm volatile("" : : : "memory");
+	sq->sq_seq++;
+}
+
+#endif	// !JOS_KERN_SEQLOCK_H
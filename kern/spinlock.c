@@ -0,0 +1,386 @@
+// Mutual exclusion spin locks.
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/kdebug.h>
+#include <kern/time.h>
+
+// The big kernel lock
+struct mcslock kernel_lock = {
+	.name = "kernel_lock"
+};
+struct mcs_node kernel_lock_nodes[NCPU];
+
+#ifdef DEBUG_SPINLOCK
+// Record the current call stack in pcs[] by following the %ebp chain.
+static void
+get_caller_pcs(uint32_t pcs[])
+{
+	uint32_t *ebp;
+	int i;
+
+	ebp = (uint32_t *)read_ebp();
+	for (i = 0; i < 10; i++){
+		if (ebp == 0 || ebp < (uint32_t *)ULIM)
+			break;
+		pcs[i] = ebp[1];          // saved %eip
+		ebp = (uint32_t *)ebp[0]; // saved %ebp
+	}
+	for (; i < 10; i++)
+		pcs[i] = 0;
+}
+
+// Check whether this CPU is holding the lock.
+static int
+holding(struct spinlock *lock)
+{
+	return lock->next != lock->owner && lock->cpu == thiscpu;
+}
+
+static int
+mcs_holding(struct mcslock *lock)
+{
+	return lock->tail && lock->cpu == thiscpu;
+}
+
+// Complain that this CPU released a lock it does not hold.
+static void
+bad_release(const char *name, struct CpuInfo *cpu, const uintptr_t *lk_pcs)
+{
+	int i;
+	uint32_t pcs[10];
+
+	// Nab the acquiring EIP chain before it gets released
+	memmove(pcs, lk_pcs, sizeof pcs);
+	cprintf("CPU %d cannot release %s: held by CPU %d\nAcquired at:",
+		cpunum(), name, cpu ? cpu->cpu_id : -1);
+	for (i = 0; i < 10 && pcs[i]; i++) {
+		struct Eipdebuginfo info;
+		if (debuginfo_eip(pcs[i], &info) >= 0)
+			cprintf("  %08x %s:%d: %.*s+%x\n", pcs[i],
+				info.eip_file, info.eip_line,
+				info.eip_fn_namelen, info.eip_fn_name,
+				pcs[i] - info.eip_fn_addr);
+		else
+			cprintf("  %08x\n", pcs[i]);
+	}
+	panic("spin_unlock");
+}
+#endif
+
+#ifdef LOCK_STATS
+// Every lock that has been acquired, most recent first.  Locks join the
+// first time they are acquired, so statically initialized ones need no
+// registering.
+static struct Lock_stats *volatile lock_stats_list;
+
+// Account for an acquisition of a lock that started waiting at TSC t0.
+static void
+lock_stats_acquired(struct Lock_stats *ls, const char *name, uint64_t t0,
+		    bool contended)
+{
+	uint64_t now = read_tsc();
+	struct Lock_stats *next;
+
+	if (!ls->ls_listed) {
+		ls->ls_name = name;
+		ls->ls_listed = 1;
+		// Other CPUs may be adding other locks.
+		do {
+			next = lock_stats_list;
+			ls->ls_next = next;
+		} while (cmpxchg((volatile uint32_t *) &lock_stats_list,
+				 (uint32_t) next, (uint32_t) ls)
+			 != (uint32_t) next);
+	}
+	ls->ls_nacquire++;
+	if (contended) {
+		ls->ls_ncontended++;
+		ls->ls_spin_cycles += now - t0;
+	}
+	ls->ls_acquired = now;
+}
+
+static void
+lock_stats_release(struct Lock_stats *ls)
+{
+	ls->ls_hold_max = MAX(ls->ls_hold_max, read_tsc() - ls->ls_acquired);
+}
+#endif
+
+void
+__spin_initlock(struct spinlock *lk, char *name)
+{
+	lk->next = lk->owner = 0;
+	lk->name = name;
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = 0;
+#endif
+#ifdef LOCK_STATS
+	memset(&lk->stats, 0, sizeof(lk->stats));
+#endif
+}
+
+// Acquire the lock.
+// Loops (spins) until the lock is acquired.
+// Holding a lock for a long time may cause
+// other CPUs to waste time spinning to acquire it.
+void
+spin_lock(struct spinlock *lk)
+{
+	uint32_t ticket;
+	bool contended;
+#ifdef LOCK_STATS
+	uint64_t t0 = read_tsc();
+#endif
+
+#ifdef DEBUG_SPINLOCK
+	if (holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+
+	// The xadd is atomic, so every CPU gets a different ticket.
+	// It also serializes, so that reads after acquire are not
+	// reordered before it.
+	ticket = xadd(&lk->next, 1);
+	contended = lk->owner != ticket;
+	while (lk->owner != ticket)
+		asm volatile ("pause");
+	asm volatile("" : : : "memory");
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(&lk->stats, lk->name, t0, contended);
+#endif
+	// Record info about lock acquisition for debugging.
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
+	get_caller_pcs(lk->pcs);
+#endif
+}
+
+// Release the lock.
+void
+spin_unlock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (!holding(lk))
+		bad_release(lk->name, lk->cpu, lk->pcs);
+
+	lk->pcs[0] = 0;
+	lk->cpu = 0;
+#endif
+#ifdef LOCK_STATS
+	lock_stats_release(&lk->stats);
+#endif
+
+	// Only the holder writes owner, so a plain store hands the lock
+	// to the next ticket: x86 does not reorder it before the
+	// critical section's loads and stores, and the barrier keeps the
+	// compiler from doing so.
+	asm volatile("" : : : "memory");
+	lk->owner++;
+}
+
+void
+__mcs_initlock(struct mcslock *lk, char *name)
+{
+	lk->tail = NULL;
+	lk->name = name;
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = 0;
+#endif
+#ifdef LOCK_STATS
+	memset(&lk->stats, 0, sizeof(lk->stats));
+#endif
+}
+
+// Acquire the lock, waiting in line behind 'me'.  'me' must stay put
+// until mcs_unlock(lk, me).
+void
+mcs_lock(struct mcslock *lk, struct mcs_node *me)
+{
+	struct mcs_node *prev;
+#ifdef LOCK_STATS
+	uint64_t t0 = read_tsc();
+#endif
+
+#ifdef DEBUG_SPINLOCK
+	if (mcs_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+
+	me->mn_next = NULL;
+	me->mn_wait = 1;
+	prev = (struct mcs_node *) xchg((volatile uint32_t *) &lk->tail,
+					(uint32_t) me);
+	if (prev) {
+		// Join the queue and wait for prev to hand the lock over.
+		prev->mn_next = me;
+		while (me->mn_wait)
+			asm volatile ("pause");
+	}
+	asm volatile("" : : : "memory");
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(&lk->stats, lk->name, t0, prev != NULL);
+#endif
+#ifdef DEBUG_SPINLOCK
+	lk->cpu = thiscpu;
+	get_caller_pcs(lk->pcs);
+#endif
+}
+
+// Release the lock, which the caller took with mcs_lock(lk, me).
+void
+mcs_unlock(struct mcslock *lk, struct mcs_node *me)
+{
+#ifdef DEBUG_SPINLOCK
+	if (!mcs_holding(lk))
+		bad_release(lk->name, lk->cpu, lk->pcs);
+
+	lk->pcs[0] = 0;
+	lk->cpu = 0;
+#endif
+#ifdef LOCK_STATS
+	lock_stats_release(&lk->stats);
+#endif
+
+	asm volatile("" : : : "memory");
+	if (!me->mn_next) {
+		// No one waiting: free the lock, unless someone has just
+		// swapped themselves in as the tail.  Then wait for them
+		// to link in behind us.
+		if (cmpxchg((volatile uint32_t *) &lk->tail, (uint32_t) me, 0)
+		    == (uint32_t) me)
+			return;
+		while (!me->mn_next)
+			asm volatile ("pause");
+	}
+	me->mn_next->mn_wait = 0;
+}
+
+// Print how each lock that has been taken has been used.
+void
+lockstat_print(void)
+{
+#ifdef LOCK_STATS
+	struct Lock_stats *ls;
+
+	cprintf("%-16s %10s %10s %12s %12s\n", "lock", "acquired",
+		"contended", "avg wait ns", "max hold ns");
+	for (ls = lock_stats_list; ls; ls = ls->ls_next)
+		cprintf("%-16s %10llu %10llu %12llu %12llu\n", ls->ls_name,
+			ls->ls_nacquire, ls->ls_ncontended,
+			ls->ls_ncontended
+			? tsc_to_ns(ls->ls_spin_cycles) / ls->ls_ncontended
+			: 0, tsc_to_ns(ls->ls_hold_max));
+#else
+	cprintf("Lock statistics are disabled: see LOCK_STATS "
+		"in kern/spinlock.h\n");
+#endif
+}
+
+// Zero every lock's statistics.  A lock held meanwhile, such as the big
+// kernel lock, still counts the rest of its hold when released.
+void
+lockstat_reset(void)
+{
+#ifdef LOCK_STATS
+	struct Lock_stats *ls;
+
+	for (ls = lock_stats_list; ls; ls = ls->ls_next) {
+		ls->ls_nacquire = ls->ls_ncontended = 0;
+		ls->ls_spin_cycles = ls->ls_hold_max = 0;
+	}
+#endif
+}
+
+
+/***** Self-test *****/
+
+#ifdef LOCK_STATS
+static bool
+lock_stats_listed(struct Lock_stats *ls)
+{
+	struct Lock_stats *p;
+
+	for (p = lock_stats_list; p; p = p->ls_next)
+		if (p == ls)
+			return 1;
+	return 0;
+}
+#endif
+
+// Take and release a lock of each kind, on this CPU alone.  Another
+// CPU's place in the queue is played by hand: a ticket taken, or a node
+// linked in, while the lock is held.
+void
+check_locks(void)
+{
+	static struct spinlock lk;
+	static struct mcslock ml;
+	struct mcs_node me, other;
+	uint32_t ticket;
+	int i;
+
+	spin_initlock(&lk);
+	for (i = 0; i < 3; i++) {
+		spin_lock(&lk);
+		assert(lk.next == lk.owner + 1);
+#ifdef DEBUG_SPINLOCK
+		assert(holding(&lk));
+#endif
+		spin_unlock(&lk);
+		assert(lk.next == lk.owner);
+	}
+	assert(lk.owner == 3);
+
+	// A release hands the lock to the next ticket.
+	spin_lock(&lk);
+	ticket = xadd(&lk.next, 1);
+	spin_unlock(&lk);
+	assert(lk.owner == ticket);
+	lk.owner++;
+	assert(lk.next == lk.owner);
+
+	mcs_initlock(&ml);
+	for (i = 0; i < 3; i++) {
+		mcs_lock(&ml, &me);
+		assert(ml.tail == &me);
+#ifdef DEBUG_SPINLOCK
+		assert(mcs_holding(&ml));
+#endif
+		mcs_unlock(&ml, &me);
+		assert(ml.tail == NULL);
+	}
+
+	// A release hands the lock to the next node in the queue, and only
+	// then does the queue empty.
+	mcs_lock(&ml, &me);
+	other.mn_next = NULL;
+	other.mn_wait = 1;
+	assert(xchg((volatile uint32_t *) &ml.tail, (uint32_t) &other)
+	       == (uint32_t) &me);
+	me.mn_next = &other;
+	mcs_unlock(&ml, &me);
+	assert(!other.mn_wait && ml.tail == &other);
+#ifdef DEBUG_SPINLOCK
+	ml.cpu = thiscpu;	// As the new holder would
+#endif
+	mcs_unlock(&ml, &other);
+	assert(ml.tail == NULL);
+
+#ifdef LOCK_STATS
+	// The acquisitions played by hand do not count.
+	assert(lk.stats.ls_nacquire == 4 && lk.stats.ls_ncontended == 0);
+	assert(ml.stats.ls_nacquire == 4 && ml.stats.ls_ncontended == 0);
+	assert(lock_stats_listed(&lk.stats) && lock_stats_listed(&ml.stats));
+#endif
+
+	cprintf("check_locks() succeeded!\n");
+}
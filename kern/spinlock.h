@@ -0,0 +1,109 @@
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+// Comment this to disable spinlock debugging
+#define DEBUG_SPINLOCK
+
+// Comment this to disable per-lock statistics
+#define LOCK_STATS
+
+#ifdef LOCK_STATS
+// How a lock has been used, shown by lockstat_print().  Updated only
+// by the lock's holder.
+struct Lock_stats {
+	const char *ls_name;
+	struct Lock_stats *ls_next;	// Next on lockstat_print()'s list
+	bool ls_listed;			// On that list yet?
+	uint64_t ls_nacquire;		// Times acquired
+	uint64_t ls_ncontended;		// ... after waiting for another CPU
+	uint64_t ls_spin_cycles;	// Total time waiting
+	uint64_t ls_hold_max;		// Longest time held, in cycles
+	uint64_t ls_acquired;		// TSC when last acquired
+};
+#endif
+
+// Mutual exclusion lock: a ticket lock, so CPUs get the lock in the
+// order they asked for it.  For short critical sections: every waiter
+// spins on lk->owner, so each release sends it to all of them.
+struct spinlock {
+	volatile uint32_t next;	// Next ticket to hand out
+	volatile uint32_t owner;	// Ticket that holds the lock
+	char *name;            // Name of lock.
+
+#ifdef DEBUG_SPINLOCK
+	// For debugging:
+	struct CpuInfo *cpu;   // The CPU holding the lock.
+	uintptr_t pcs[10];     // The call stack (an array of program counters)
+	                       // that locked the lock.
+#endif
+#ifdef LOCK_STATS
+	struct Lock_stats stats;
+#endif
+};
+
+void __spin_initlock(struct spinlock *lk, char *name);
+void spin_lock(struct spinlock *lk);
+void spin_unlock(struct spinlock *lk);
+
+#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+
+// A waiter in an MCS queue lock.  Each CPU waiting for or holding the
+// lock brings its own node and spins on that alone.
+struct mcs_node {
+	struct mcs_node *volatile mn_next;	// Next waiter
+	volatile uint32_t mn_wait;		// Set until the lock is ours
+};
+
+// MCS queue lock: FIFO like the ticket lock, but a release touches
+// only the next waiter's node, so it stays cheap under contention.
+struct mcslock {
+	struct mcs_node *volatile tail;	// Last waiter, or NULL if free
+	char *name;
+
+#ifdef DEBUG_SPINLOCK
+	struct CpuInfo *cpu;
+	uintptr_t pcs[10];
+#endif
+#ifdef LOCK_STATS
+	struct Lock_stats stats;
+#endif
+};
+
+void __mcs_initlock(struct mcslock *lk, char *name);
+void mcs_lock(struct mcslock *lk, struct mcs_node *me);
+void mcs_unlock(struct mcslock *lk, struct mcs_node *me);
+
+#define mcs_initlock(lock)    __mcs_initlock(lock, #lock)
+
+void lockstat_print(void);
+void lockstat_reset(void);
+void check_locks(void);
+
+// The big kernel lock.  A CPU holds it whenever it runs kernel code,
+// except while halted in cpu_idle().  Every CPU contends for it, so it
+// is an MCS lock, with a queue node per CPU.
+extern struct mcslock kernel_lock;
+extern struct mcs_node kernel_lock_nodes[NCPU];
+
+static inline void
+lock_kernel(void)
+{
+	mcs_lock(&kernel_lock, &kernel_lock_nodes[cpunum()]);
+}
+
+static inline void
+unlock_kernel(void)
+{
+	// The lock goes straight to the next CPU in the queue, so,
+	// unlike with a test-and-set lock, this CPU cannot take it
+	// back before a waiting one has had its turn.
+	mcs_unlock(&kernel_lock, &kernel_lock_nodes[cpunum()]);
+}
+
+#endif
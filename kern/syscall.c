@@ -0,0 +1,125 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/trap.h>
+#include <kern/syscall.h>
+#include <kern/console.h>
+#include <kern/time.h>
+
+// Print a string to the system console.
+// The string is exactly 'len' characters long.
+// Returns -E_FAULT if the memory is not the user's to read.
+static int
+sys_cputs(const char *s, size_t len)
+{
+	uintptr_t va;
+
+	if ((uintptr_t) s >= UTOP || len > UTOP - (uintptr_t) s)
+		return -E_FAULT;
+	for (va = ROUNDDOWN((uintptr_t) s, PGSIZE); va < (uintptr_t) s + len;
+	     va += PGSIZE) {
+		pte_t *pte = pgdir_walk(kern_pgdir, (void *) va, 0);
+		if (!pte || (*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+			return -E_FAULT;
+	}
+
+	// Print the string supplied by the user.
+	cprintf("%.*s", len, s);
+	return 0;
+}
+
+// Read a character from the system console without blocking.
+// Returns the character, or 0 if there is no input waiting.
+static int
+sys_cgetc(void)
+{
+	return cons_getc();
+}
+
+// Returns the current environment's envid.  There are no environments
+// yet, so this is always 0: it makes a good null system call.
+static int
+sys_getenvid(void)
+{
+	return 0;
+}
+
+// Dispatches to the correct kernel function, passing the arguments.
+int32_t
+syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	switch (syscallno) {
+	case SYS_cputs:
+		return sys_cputs((const char *) a1, a2);
+	case SYS_cgetc:
+		return sys_cgetc();
+	case SYS_getenvid:
+		return sys_getenvid();
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Time 'ncalls' null system calls from user mode through the interrupt
+// gate, then as many through sysenter, and print the cycles per call.
+// The user half, sysprobe_user in trapentry.S, runs from a page mapped
+// at UTEXT, which doubles as its stack.
+void
+syscall_probe(int ncalls)
+{
+	extern char sysprobe_user[], sysprobe_user_end[];
+	struct PageInfo *pp;
+	struct Trapframe tf;
+	uint32_t *top, edx;
+	pte_t *pte;
+	int trapno;
+
+	if (ncalls <= 0)
+		return;
+	if (!(pp = page_alloc(ALLOC_ZERO))
+	    || !(pte = pgdir_walk(kern_pgdir, (void *) UTEXT, 1))) {
+		cprintf("syscall_probe: out of memory\n");
+		if (pp)
+			page_free(pp);
+		return;
+	}
+	cpuid(1, NULL, NULL, NULL, &edx);
+
+	memcpy(page2kva(pp), sysprobe_user, sysprobe_user_end - sysprobe_user);
+	top = (uint32_t *) ((char *) page2kva(pp) + PGSIZE);
+	top[-2] = ncalls;
+	top[-1] = (edx & CPUID_EDX_SEP) ? ncalls : 0;
+	*pte = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+
+	memset(&tf, 0, sizeof(tf));
+	tf.tf_regs.reg_ebx = SYS_getenvid;
+	tf.tf_ds = tf.tf_es = tf.tf_ss = GD_UD | 3;
+	tf.tf_cs = GD_UT | 3;
+	tf.tf_eip = UTEXT;
+	tf.tf_esp = UTEXT + PGSIZE - 2 * sizeof(uint32_t);
+	trapno = user_run(&tf);
+
+	*pte = 0;
+	invlpg((void *) UTEXT);
+
+	if (trapno != T_BRKPT)
+		cprintf("syscall_probe: user code took trap %d\n", trapno);
+	else {
+		cprintf("null system call, per call over %d calls:\n", ncalls);
+		cprintf("  int $%d   %6llu cycles %6llu ns\n", T_SYSCALL,
+			*(uint64_t *) &top[-4] / ncalls,
+			tsc_to_ns(*(uint64_t *) &top[-4]) / ncalls);
+		if (top[-1])
+			cprintf("  sysenter  %6llu cycles %6llu ns\n",
+				*(uint64_t *) &top[-6] / ncalls,
+				tsc_to_ns(*(uint64_t *) &top[-6]) / ncalls);
+		else
+			cprintf("  sysenter  (not supported by this CPU)\n");
+	}
+	page_free(pp);
+}
@@ -0,0 +1,214 @@
+// Timekeeping.
+//
+// The TSC is the kernel's clock: reading it costs a few cycles, where
+// reading the PIT or the RTC costs several slow I/O port accesses.
+// time_init() measures its frequency against the PIT, and ktime_get()
+// turns it into nanoseconds since boot.  The wall clock is that plus a
+// base read from the RTC, kept under a seqlock so that readers see a
+// consistent 64-bit value while it is being set.
+
+#include <inc/stdio.h>
+#include <inc/x86.h>
+
+#include <kern/time.h>
+#include <kern/kclock.h>
+#include <kern/seqlock.h>
+
+// The 8253/8254 programmable interval timer
+#define TIMER_FREQ	1193182		// input clock, Hz
+#define TIMER_CNTR2	0x42		// counter 2, gated by port B
+#define TIMER_MODE	0x43
+#define   TIMER_SEL2	0x80		// select counter 2
+#define   TIMER_16BIT	0x30		// r/w counter 16 bits, LSB first
+#define   TIMER_INTTC	0x00		// mode 0: interrupt on terminal count
+#define IO_PORTB	0x61		// keyboard controller port B
+#define   PORTB_GATE2	0x01		// counter 2 gate
+#define   PORTB_SPKR	0x02		// speaker data
+#define   PORTB_OUT2	0x20		// counter 2 output
+
+#define CAL_MS		10		// length of one calibration run
+#define CAL_RUNS	5
+
+// RTC registers
+#define RTC_SEC		0x00
+#define RTC_MIN		0x02
+#define RTC_HOUR	0x04
+#define RTC_DAY		0x07
+#define RTC_MONTH	0x08
+#define RTC_YEAR	0x09
+#define RTC_STATUSA	0x0a
+#define   RTCSA_TUP	0x80		// time update in progress
+#define RTC_STATUSB	0x0b
+#define   RTCSB_24HR	0x02		// 24-hour clock
+#define   RTCSB_BCD	0x04		// 0 = BCD, 1 = binary
+
+uint32_t tsc_khz;
+uint32_t tsc_mult;
+uint64_t tsc_base;
+
+static struct Wallclock {
+	struct Seqlock wc_lock;
+	uint64_t wc_base;		// ns since the epoch at ktime 0
+} wallclock;
+
+// TSC cycles while PIT counter 2 counts down CAL_MS milliseconds, or 0
+// if it never finishes (no PIT).
+static uint64_t
+pit_cal_run(void)
+{
+	uint16_t latch = TIMER_FREQ * CAL_MS / 1000;
+	uint64_t t0, t1;
+	uint32_t n;
+
+	// Gate counter 2 on with the speaker off, and start it in mode 0:
+	// its output goes high when the count reaches zero.
+	outb(IO_PORTB, (inb(IO_PORTB) & ~PORTB_SPKR) | PORTB_GATE2);
+	outb(TIMER_MODE, TIMER_SEL2 | TIMER_16BIT | TIMER_INTTC);
+	outb(TIMER_CNTR2, latch & 0xff);
+	outb(TIMER_CNTR2, latch >> 8);
+
+	t0 = read_tsc();
+	for (n = 0; !(inb(IO_PORTB) & PORTB_OUT2); n++)
+		if (n == 10000000)
+			return 0;
+	t1 = read_tsc();
+	return t1 - t0;
+}
+
+// Measure the TSC frequency against the PIT.  An interruption can only
+// make a run look longer, so take the shortest.
+static uint32_t
+tsc_calibrate(void)
+{
+	uint64_t t, min = ~0ULL;
+	int i;
+
+	for (i = 0; i < CAL_RUNS; i++) {
+		t = pit_cal_run();
+		if (t == 0)
+			return 0;
+		if (t < min)
+			min = t;
+	}
+	// min cycles in (latch / TIMER_FREQ) seconds
+	return min * TIMER_FREQ / ((TIMER_FREQ * CAL_MS / 1000) * 1000ULL);
+}
+
+static unsigned
+rtc_read(unsigned reg, bool bcd)
+{
+	unsigned v = mc146818_read(reg);
+
+	return bcd ? (v >> 4) * 10 + (v & 0xf) : v;
+}
+
+// Days from 1970-01-01 to year-month-day (proleptic Gregorian).
+static uint32_t
+days_from_civil(int y, unsigned m, unsigned d)
+{
+	unsigned era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = y / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+// Seconds since the epoch, from the RTC.
+static uint64_t
+rtc_get_time(void)
+{
+	unsigned sec, min, hour, day, mon, year, century, statusb;
+	bool bcd, pm;
+
+	// Wait out an update, which takes under 2ms, so the fields agree.
+	while (mc146818_read(RTC_STATUSA) & RTCSA_TUP)
+		/* do nothing */;
+	statusb = mc146818_read(RTC_STATUSB);
+	bcd = !(statusb & RTCSB_BCD);
+
+	sec = rtc_read(RTC_SEC, bcd);
+	min = rtc_read(RTC_MIN, bcd);
+	hour = mc146818_read(RTC_HOUR);
+	pm = !(statusb & RTCSB_24HR) && (hour & 0x80);
+	hour = bcd ? ((hour & 0x70) >> 4) * 10 + (hour & 0xf) : hour & 0x7f;
+	if (!(statusb & RTCSB_24HR))
+		hour = hour % 12 + (pm ? 12 : 0);
+	day = rtc_read(RTC_DAY, bcd);
+	mon = rtc_read(RTC_MONTH, bcd);
+	year = rtc_read(RTC_YEAR, bcd);
+	century = rtc_read(NVRAM_CENTURY, bcd);
+	if (century < 19 || century > 99)
+		century = year < 70 ? 20 : 19;
+	year += century * 100;
+
+	return (uint64_t) days_from_civil(year, mon, day) * 86400
+		+ hour * 3600 + min * 60 + sec;
+}
+
+void
+time_init(void)
+{
+	tsc_khz = tsc_calibrate();
+	if (tsc_khz == 0) {
+		cprintf("time_init: no PIT; assuming a 1GHz TSC\n");
+		tsc_khz = 1000000;
+	}
+	tsc_mult = (NSEC_PER_MSEC << TSC_SHIFT) / tsc_khz;
+	tsc_base = read_tsc();
+
+	ktime_set_real(rtc_get_time() * NSEC_PER_SEC);
+	cprintf("TSC: %u.%03u MHz\n", tsc_khz / 1000, tsc_khz % 1000);
+}
+
+// Nanoseconds since the epoch.
+uint64_t
+ktime_get_real(void)
+{
+	uint64_t base;
+	uint32_t seq;
+
+	do {
+		seq = seq_read_begin(&wallclock.wc_lock);
+		base = wallclock.wc_base;
+	} while (seq_read_retry(&wallclock.wc_lock, seq));
+	return base + ktime_get();
+}
+
+// Set the wall clock to 'ns' nanoseconds since the epoch.
+// Callers must not race with each other.
+void
+ktime_set_real(uint64_t ns)
+{
+	seq_write_begin(&wallclock.wc_lock);
+	wallclock.wc_base = ns - ktime_get();
+	seq_write_end(&wallclock.wc_lock);
+}
+
+void
+time_print(void)
+{
+	uint64_t up = ktime_get(), now = ktime_get_real() / NSEC_PER_SEC;
+	uint32_t days = now / 86400, secs = now % 86400;
+	unsigned era, doe, yoe, doy, mp, y, m, d;
+
+	// The inverse of days_from_civil().
+	days += 719468;
+	era = days / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y += m <= 2;
+
+	cprintf("TSC frequency  %u.%03u MHz\n", tsc_khz / 1000, tsc_khz % 1000);
+	cprintf("uptime         %llu.%06llu s\n", up / NSEC_PER_SEC,
+		up % NSEC_PER_SEC / NSEC_PER_USEC);
+	cprintf("wall clock     %04u-%02u-%02u %02u:%02u:%02u UTC\n",
+		y, m, d, secs / 3600, secs / 60 % 60, secs % 60);
+}
@@ -0,0 +1,51 @@
+#ifndef JOS_KERN_TIME_H
+#define JOS_KERN_TIME_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/x86.h>
+
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+// Cycles convert to nanoseconds as (cycles * tsc_mult) >> TSC_SHIFT,
+// which is exact enough and needs no division.
+#define TSC_SHIFT	22
+
+extern uint32_t tsc_khz;	// TSC frequency, set by time_init()
+extern uint32_t tsc_mult;
+extern uint64_t tsc_base;	// TSC value at ktime 0
+
+void	time_init(void);
+uint64_t ktime_get_real(void);
+void	ktime_set_real(uint64_t ns);
+void	time_print(void);
+
+// Nanoseconds in 'cycles' TSC cycles.  The 64-by-32-bit product is
+// done in two halves so that it cannot overflow.
+static inline uint64_t
+tsc_to_ns(uint64_t cycles)
+{
+	return (((cycles & 0xffffffff) * tsc_mult) >> TSC_SHIFT)
+		+ (((cycles >> 32) * tsc_mult) << (32 - TSC_SHIFT));
+}
+
+// TSC cycles in 'ns' nanoseconds.
+static inline uint64_t
+ns_to_tsc(uint64_t ns)
+{
+	return ns / NSEC_PER_MSEC * tsc_khz
+		+ ns % NSEC_PER_MSEC * tsc_khz / NSEC_PER_MSEC;
+}
+
+// Nanoseconds since time_init(): the kernel's monotonic clock.
+static inline uint64_t
+ktime_get(void)
+{
+	return tsc_to_ns(read_tsc() - tsc_base);
+}
+
+#endif	// !JOS_KERN_TIME_H
@@ -0,0 +1,559 @@
+// Kernel timers.
+//
+// Pending timers live on a hashed hierarchical timer wheel.  Time is
+// counted in ticks of TW_TICK_NS, about 65us.  The wheel has TW_LEVELS
+// levels of TW_SIZE slots; level L holds the timers due between
+// TW_SIZE^L and TW_SIZE^(L+1) ticks from now, hashed by the level-L
+// digits of their expiry tick.  Adding or cancelling a timer is O(1).
+// When the wheel reaches the start of a level-L slot's range, that slot
+// cascades: its timers move down to lower levels.  Level 0 slots hold
+// timers due on a single tick, and expire together.
+//
+// There is still no periodic tick.  A bitmap of the non-empty slots on
+// each level gives the next tick at which anything happens, an expiry
+// or a cascade, and the LAPIC timer is programmed for just that tick.
+// The wheel skips straight over the ticks in between.
+//
+// Each CPU has a wheel of its own, driven by its own LAPIC timer, and
+// a timer runs on the CPU that added it.  Timers are only touched with
+// interrupts off and under the big kernel lock.
+
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/timer.h>
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/kmem.h>
+#include <kern/spinlock.h>
+
+#define TW_TICK_SHIFT	16		// Tick length, as a power of 2 ns
+#define TW_TICK_NS	(1ULL << TW_TICK_SHIFT)
+#define TW_BITS		5		// Slots per level, as a power of 2
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	6		// Covers 2^30 ticks, about 19.5 hours
+
+// Ticks covered by each slot on 'level', as a power of 2
+#define TW_SHIFT(level)	((level) * TW_BITS)
+
+struct Timer_wheel {
+	struct Timer *tw_slot[TW_LEVELS][TW_SIZE];
+	uint32_t tw_pending[TW_LEVELS];	// Bitmap of non-empty slots
+	uint64_t tw_now;		// Next tick to process
+	uint64_t tw_armed;		// Tick the LAPIC timer is set for
+	uint64_t tw_idle_cycles;	// Cycles halted in cpu_idle()
+};
+
+static struct Timer_wheel wheels[NCPU];
+
+static bool timer_ready;		// Interrupts are set up
+
+// Statistics
+static uint64_t timer_nadd;		// timer_add() calls
+static uint64_t timer_ncancel;		// Timers cancelled
+static uint64_t timer_ncascade;		// Timers moved down a level
+static uint64_t timer_nintr;		// Timer interrupts
+static uint64_t timer_nticks;		// Ticks processed
+static uint64_t timer_nfired;		// Timers run
+static uint64_t timer_late_ns;		// Total lateness of timers run
+static uint64_t timer_late_max;		// Worst lateness
+static uint64_t timer_add_cycles;	// Cycles in timer_add()
+static uint64_t timer_cancel_cycles;	// Cycles in timer_cancel()
+static uint64_t timer_intr_cycles;	// Cycles in timer_intr()
+static uint32_t timer_npending;		// Timers on the wheel
+static uint32_t timer_max_pending;	// ... at most
+
+static void check_timer(void);
+
+// Put tm on the wheel, in the slot for its expiry tick.
+static void
+tw_enqueue(struct Timer_wheel *tw, struct Timer *tm)
+{
+	uint64_t expires, delta;
+	struct Timer **head;
+	int level, idx;
+
+	// Round up, so no timer runs early.  Ticks before tw->tw_now are
+	// done, so a timer that is already due goes on the next one.
+	expires = (tm->tm_deadline + TW_TICK_NS - 1) >> TW_TICK_SHIFT;
+	if (expires < tw->tw_now)
+		expires = tw->tw_now;
+	delta = expires - tw->tw_now;
+
+	for (level = 0; level < TW_LEVELS - 1; level++)
+		if (delta < (1ULL << TW_SHIFT(level + 1)))
+			break;
+	// Timers beyond the top level wait in its furthest slot, and
+	// cascade back into it until they are in range.
+	if (delta >= (1ULL << TW_SHIFT(TW_LEVELS)))
+		expires = tw->tw_now + (1ULL << TW_SHIFT(TW_LEVELS)) - 1;
+	idx = (expires >> TW_SHIFT(level)) & TW_MASK;
+
+	head = &tw->tw_slot[level][idx];
+	tm->tm_next = *head;
+	if (*head)
+		(*head)->tm_pprev = &tm->tm_next;
+	tm->tm_pprev = head;
+	tm->tm_slot = level * TW_SIZE + idx;
+	tm->tm_cpu = tw - wheels;
+	*head = tm;
+	tw->tw_pending[level] |= 1U << idx;
+}
+
+static void
+tw_dequeue(struct Timer *tm)
+{
+	struct Timer_wheel *tw = &wheels[tm->tm_cpu];
+	int level = tm->tm_slot / TW_SIZE, idx = tm->tm_slot % TW_SIZE;
+
+	*tm->tm_pprev = tm->tm_next;
+	if (tm->tm_next)
+		tm->tm_next->tm_pprev = tm->tm_pprev;
+	else if (!tw->tw_slot[level][idx])
+		tw->tw_pending[level] &= ~(1U << idx);
+	tm->tm_next = NULL;
+	tm->tm_pprev = NULL;
+}
+
+// The first tick, at or after tw->tw_now, at which something happens: a
+// level-0 slot expires or a higher slot cascades.  ~0 if the wheel is
+// empty.
+static uint64_t
+tw_next_event(struct Timer_wheel *tw)
+{
+	uint64_t best = ~0ULL, start, t;
+	uint32_t map;
+	int level, pos;
+
+	for (level = 0; level < TW_LEVELS; level++) {
+		if (!tw->tw_pending[level])
+			continue;
+		// The first slot-sized block starting at or after tw->tw_now,
+		// and the slot it hashes to.  Slots come round in order
+		// from there.
+		start = (tw->tw_now + (1ULL << TW_SHIFT(level)) - 1)
+			>> TW_SHIFT(level);
+		pos = start & TW_MASK;
+		map = tw->tw_pending[level];
+		if (pos)
+			map = (map >> pos) | (map << (TW_SIZE - pos));
+		t = (start + bsf(map)) << TW_SHIFT(level);
+		if (t < best)
+			best = t;
+	}
+	return best;
+}
+
+// Ask for an interrupt at the start of 'tick'.
+static void
+tw_arm(struct Timer_wheel *tw, uint64_t tick)
+{
+	tw->tw_armed = tick;
+	lapic_timer_arm(tick == ~0ULL ? ~0ULL : tick << TW_TICK_SHIFT);
+}
+
+// Call once the IDT, the interrupt controllers and the BSP's LAPIC are
+// set up: from now on cpu_idle() halts.
+void
+timer_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		wheels[i].tw_armed = ~0ULL;
+	timer_ready = 1;
+	check_timer();
+}
+
+// Call func(tm) once ktime_get() passes 'deadline'.  tm must not be
+// pending already.
+void
+timer_add(struct Timer *tm, uint64_t deadline,
+	  void (*func)(struct Timer *), void *arg)
+{
+	struct Timer_wheel *tw = &wheels[cpunum()];
+	uint64_t t0 = read_tsc(), tick;
+
+	assert(!tm->tm_pprev);
+	tm->tm_deadline = deadline;
+	tm->tm_func = func;
+	tm->tm_arg = arg;
+	tw_enqueue(tw, tm);
+
+	// Only a timer due before the programmed interrupt needs a new
+	// one.  A cascade slot might already come earlier, but a spurious
+	// interrupt is cheaper than finding out.
+	tick = (deadline + TW_TICK_NS - 1) >> TW_TICK_SHIFT;
+	if (tick < tw->tw_armed)
+		tw_arm(tw, MAX(tick, tw->tw_now));
+
+	timer_nadd++;
+	if (++timer_npending > timer_max_pending)
+		timer_max_pending = timer_npending;
+	timer_add_cycles += read_tsc() - t0;
+}
+
+// Stop tm from firing.  Returns whether it was pending.  The LAPIC
+// timer stays armed: if nothing else is due, that interrupt finds
+// nothing to do and re-arms.
+bool
+timer_cancel(struct Timer *tm)
+{
+	uint64_t t0 = read_tsc();
+
+	if (!tm->tm_pprev)
+		return 0;
+	tw_dequeue(tm);
+	timer_ncancel++;
+	timer_npending--;
+	timer_cancel_cycles += read_tsc() - t0;
+	return 1;
+}
+
+// Process tick tw->tw_now: cascade the higher slots that start here, then
+// run the timers that expire on it.  'now' is the ktime they run at.
+static void
+tw_tick(struct Timer_wheel *tw, uint64_t now)
+{
+	struct Timer *tm, *next, *batch;
+	int level, idx;
+
+	for (level = 1; level < TW_LEVELS; level++) {
+		if (tw->tw_now & ((1ULL << TW_SHIFT(level)) - 1))
+			break;
+		idx = (tw->tw_now >> TW_SHIFT(level)) & TW_MASK;
+		tm = tw->tw_slot[level][idx];
+		tw->tw_slot[level][idx] = NULL;
+		tw->tw_pending[level] &= ~(1U << idx);
+		for (; tm; tm = next) {
+			next = tm->tm_next;
+			tw_enqueue(tw, tm);
+			timer_ncascade++;
+		}
+	}
+
+	// Take the whole slot, and move on before running any of it, so
+	// that timers the functions add go on later ticks.  The functions
+	// may cancel timers still on the batch.
+	idx = tw->tw_now & TW_MASK;
+	if ((batch = tw->tw_slot[0][idx]))
+		batch->tm_pprev = &batch;
+	tw->tw_slot[0][idx] = NULL;
+	tw->tw_pending[0] &= ~(1U << idx);
+	tw->tw_now++;
+	timer_nticks++;
+
+	while ((tm = batch)) {
+		tw_dequeue(tm);
+		timer_npending--;
+		timer_nfired++;
+		timer_late_ns += now - tm->tm_deadline;
+		timer_late_max = MAX(timer_late_max, now - tm->tm_deadline);
+		tm->tm_func(tm);
+	}
+}
+
+// Run every tick that has started, skipping those with nothing to do,
+// and ask for an interrupt for the next one that has work.  The
+// interrupt may come early, when the LAPIC timer's count is too short
+// for the deadline or the timer it was armed for was cancelled; then
+// nothing is due yet.
+void
+timer_intr(void)
+{
+	struct Timer_wheel *tw = &wheels[cpunum()];
+	uint64_t t0 = read_tsc(), ns, now, tick;
+
+	timer_nintr++;
+	ns = ktime_get();
+	now = ns >> TW_TICK_SHIFT;
+	while ((tick = tw_next_event(tw)) <= now) {
+		tw->tw_now = tick;
+		tw_tick(tw, ns);
+	}
+	tw->tw_now = MAX(tw->tw_now, now + 1);
+	tw_arm(tw, tw_next_event(tw));
+	timer_intr_cycles += read_tsc() - t0;
+}
+
+// Run any timers that are due, for code that keeps interrupts off
+// for long.
+void
+timer_poll(void)
+{
+	if (wheels[cpunum()].tw_armed <= ktime_get() >> TW_TICK_SHIFT)
+		timer_intr();
+}
+
+static void
+timer_wakeup(struct Timer *tm)
+{
+	*(volatile bool *) tm->tm_arg = 1;
+}
+
+// Wait 'ns' nanoseconds, halted.
+void
+timer_sleep(uint64_t ns)
+{
+	struct Timer tm = { 0 };
+	volatile bool done = 0;
+
+	timer_add(&tm, ktime_get() + ns, timer_wakeup, (void *) &done);
+	while (!done)
+		cpu_idle();
+}
+
+// Wait for something to happen: halt until the next interrupt, which
+// is the next timer event if nothing else.  Other CPUs may take the
+// big kernel lock meanwhile.
+void
+cpu_idle(void)
+{
+	uint64_t t0;
+
+	// Without interrupts to wake us, poll.
+	if (!timer_ready || !lapic) {
+		timer_poll();
+		asm volatile("pause");
+		return;
+	}
+
+	// Let other CPUs have the big kernel lock while halted; trap()
+	// takes it back to handle the interrupt that wakes us.  sti only
+	// takes effect after the next instruction, so an interrupt sent
+	// after the caller's check still wakes the hlt.
+	t0 = read_tsc();
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	unlock_kernel();
+	asm volatile("sti; hlt; cli" : : : "memory");
+	lock_kernel();
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+	wheels[cpunum()].tw_idle_cycles += read_tsc() - t0;
+}
+
+void
+timer_print_stats(void)
+{
+	uint64_t up = ktime_get(), idle;
+	int i;
+
+	cprintf("timers: %u pending (at most %u), %llu added, "
+		"%llu cancelled, %llu run\n", timer_npending,
+		timer_max_pending, timer_nadd, timer_ncancel, timer_nfired);
+	cprintf("wheel: %llu ns ticks, %llu ticks processed, "
+		"%llu timers cascaded\n", TW_TICK_NS, timer_nticks,
+		timer_ncascade);
+	if (timer_nadd)
+		cprintf("  add      %6llu cycles\n",
+			timer_add_cycles / timer_nadd);
+	if (timer_ncancel)
+		cprintf("  cancel   %6llu cycles\n",
+			timer_cancel_cycles / timer_ncancel);
+	if (timer_nintr)
+		cprintf("  interrupt %5llu cycles, %llu interrupts\n",
+			timer_intr_cycles / timer_nintr, timer_nintr);
+	if (timer_nfired)
+		cprintf("  late     %6llu ns average, %llu ns worst\n",
+			timer_late_ns / timer_nfired, timer_late_max);
+	for (i = 0; i < ncpu; i++) {
+		idle = tsc_to_ns(wheels[i].tw_idle_cycles);
+		cprintf("CPU %d idle %llu.%03llu s of %llu.%03llu s uptime\n",
+			i, idle / NSEC_PER_SEC,
+			idle % NSEC_PER_SEC / NSEC_PER_MSEC,
+			up / NSEC_PER_SEC, up % NSEC_PER_SEC / NSEC_PER_MSEC);
+	}
+}
+
+// A timer for timer_stress(), on its list of them
+struct Stress_timer {
+	struct Timer st_timer;
+	struct Stress_timer *st_next;
+};
+
+static void
+timer_count(struct Timer *tm)
+{
+	(*(int *) tm->tm_arg)++;
+}
+
+// Load the wheel with 'ntimers' timers due at scattered times over the
+// next 50ms, cancel every other one, wait for the rest, and print what
+// each step cost.
+void
+timer_stress(int ntimers)
+{
+	static struct Kmem_cache *stress_cache;
+	struct Stress_timer *list = NULL, *st;
+	uint64_t t0, t1, t2, nintr, late_max;
+	uint32_t seed = 1;
+	int n, i, nfired = 0;
+
+	if (!stress_cache
+	    && !(stress_cache = kmem_cache_create("stress_timer",
+						  sizeof(struct Stress_timer),
+						  sizeof(uint64_t), NULL))) {
+		cprintf("timer_stress: out of memory\n");
+		return;
+	}
+	for (n = 0; n < ntimers; n++) {
+		if (!(st = kmem_cache_alloc(stress_cache)))
+			break;
+		st->st_timer.tm_pprev = NULL;
+		st->st_next = list;
+		list = st;
+	}
+	if (n < ntimers)
+		cprintf("timer_stress: out of memory after %d timers\n", n);
+	if (!n)
+		return;
+
+	nintr = timer_nintr;
+	late_max = timer_late_max;
+	timer_late_max = 0;
+	t0 = read_tsc();
+	for (st = list; st; st = st->st_next) {
+		seed = seed * 1103515245 + 12345;
+		timer_add(&st->st_timer, ktime_get() + NSEC_PER_MSEC
+			  + (seed >> 8) % (49 * NSEC_PER_MSEC),
+			  timer_count, &nfired);
+	}
+	t1 = read_tsc();
+	for (st = list, i = 0; st; st = st->st_next, i++)
+		if (i % 2 == 0)
+			timer_cancel(&st->st_timer);
+	t2 = read_tsc();
+	timer_sleep(60 * NSEC_PER_MSEC);
+
+	cprintf("%d timers: add %llu cycles each, cancel %llu cycles each\n",
+		n, (t1 - t0) / n, (t2 - t1) / ((n + 1) / 2));
+	cprintf("%d of %d left ran, in %llu interrupts, at worst %llu ns late\n",
+		nfired, n / 2, timer_nintr - nintr, timer_late_max);
+	timer_late_max = MAX(timer_late_max, late_max);
+
+	while ((st = list)) {
+		list = st->st_next;
+		timer_cancel(&st->st_timer);
+		kmem_cache_free(stress_cache, st);
+	}
+}
+
+
+/***** Self-test *****/
+
+// A timer for check_timer(), and the tick it should run on
+struct Check_timer {
+	struct Timer ct_timer;
+	uint64_t ct_tick;
+	struct Check_timer *ct_cancel;	// To cancel when this one runs
+	bool ct_fired;
+};
+
+static uint64_t check_last_tick;
+
+static void
+check_timer_fire(struct Timer *tm)
+{
+	struct Check_timer *ct = tm->tm_arg;
+	// tw_tick() has moved on past the tick it is running.
+	uint64_t tick = wheels[cpunum()].tw_now - 1;
+
+	assert(tm->tm_deadline <= tick << TW_TICK_SHIFT);
+	assert(tick == ct->ct_tick);
+	assert(tick >= check_last_tick);
+	assert(!ct->ct_fired);
+	check_last_tick = tick;
+	ct->ct_fired = 1;
+	if (ct->ct_cancel)
+		assert(timer_cancel(&ct->ct_cancel->ct_timer));
+}
+
+// Run timers on every level of this CPU's wheel, and beyond its reach,
+// in simulated time: step the wheel from event to event instead of
+// waiting.  Check that each runs on the tick its deadline rounds up to,
+// in order, and that cancelled ones do not run at all.
+static void
+check_timer(void)
+{
+	static struct Check_timer cts[TW_LEVELS * 4 + 6];
+	static struct Timer_wheel saved;
+	struct Timer_wheel *tw = &wheels[cpunum()];
+	uint64_t start, tick, deadline, late_ns, late_max, nfired;
+	uint32_t seed = 1;
+	int n = 0, i, level;
+
+	saved = *tw;
+	late_ns = timer_late_ns;
+	late_max = timer_late_max;
+	nfired = timer_nfired;
+	memset(tw, 0, sizeof(*tw));
+	// Start with every digit of the tick non-zero, so that the first
+	// cascade on each level comes before its slots have come round.
+	start = tw->tw_now = 0x12345678ULL;
+	tw->tw_armed = ~0ULL;
+
+	// Timers due on the first and last ticks in the range of each
+	// level, and at two scattered ticks in between.  Then some beyond
+	// the top level, up to three times its reach.
+	for (level = 0; level < TW_LEVELS; level++) {
+		cts[n++].ct_tick = start + (1ULL << TW_SHIFT(level));
+		cts[n++].ct_tick = start + (1ULL << TW_SHIFT(level + 1)) - 1;
+		for (i = 0; i < 2; i++) {
+			seed = seed * 1103515245 + 12345;
+			cts[n++].ct_tick = start + (1ULL << TW_SHIFT(level))
+				+ (((uint64_t) TW_MASK << TW_SHIFT(level))
+				   * (seed >> 8) >> 24);
+		}
+	}
+	cts[n++].ct_tick = start + (1ULL << TW_SHIFT(TW_LEVELS));
+	cts[n++].ct_tick = start + (1ULL << TW_SHIFT(TW_LEVELS)) * 3 + 7;
+	// Two due on the same tick; whichever runs first cancels the other.
+	cts[n++].ct_tick = start + 100;
+	cts[n++].ct_tick = start + 100;
+	cts[n - 2].ct_cancel = &cts[n - 1];
+	cts[n - 1].ct_cancel = &cts[n - 2];
+	// Due now, and already overdue: both run on the first tick.
+	cts[n++].ct_tick = start;
+	cts[n++].ct_tick = start;
+	assert(n == ARRAY_SIZE(cts));
+
+	// Deadlines up to a tick before ct_tick round up to it.
+	for (i = 0; i < n; i++) {
+		seed = seed * 1103515245 + 12345;
+		deadline = (cts[i].ct_tick << TW_TICK_SHIFT)
+			- (seed >> 8) % TW_TICK_NS;
+		if (i == n - 1)
+			deadline = (start - 5) << TW_TICK_SHIFT;
+		cts[i].ct_timer.tm_pprev = NULL;
+		timer_add(&cts[i].ct_timer, deadline, check_timer_fire, &cts[i]);
+	}
+	for (i = 0; i < n - 4; i += 3)
+		assert(timer_cancel(&cts[i].ct_timer));
+	assert(!timer_cancel(&cts[0].ct_timer));
+
+	check_last_tick = 0;
+	while ((tick = tw_next_event(tw)) != ~0ULL) {
+		assert(tick >= tw->tw_now);
+		tw->tw_now = tick;
+		tw_tick(tw, tick << TW_TICK_SHIFT);
+	}
+	for (level = 0; level < TW_LEVELS; level++)
+		assert(!tw->tw_pending[level]);
+
+	for (i = 0; i < n - 4; i++)
+		assert(cts[i].ct_fired == (i % 3 != 0));
+	assert(cts[n - 4].ct_fired + cts[n - 3].ct_fired == 1);
+	assert(cts[n - 2].ct_fired && cts[n - 1].ct_fired);
+
+	// Put back this CPU's wheel as it was, and the lateness
+	// statistics, which simulated time would only muddle.
+	*tw = saved;
+	tw_arm(tw, tw_next_event(tw));
+	timer_late_ns = late_ns;
+	timer_late_max = late_max;
+	timer_nfired = nfired;
+
+	cprintf("check_timer() succeeded!\n");
+}
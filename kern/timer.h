@@ -0,0 +1,35 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// A kernel timer.  Once ktime_get() passes tm_deadline, tm_func is
+// called with the timer, from the timer interrupt, with interrupts off.
+// The timer is no longer pending by then, so tm_func may add it again.
+struct Timer {
+	uint64_t tm_deadline;		// ktime, in nanoseconds
+	void (*tm_func)(struct Timer *);
+	void *tm_arg;			// For tm_func's use
+
+	struct Timer *tm_next;		// Other timers in the same wheel slot
+	struct Timer **tm_pprev;	// NULL if not pending
+	uint8_t tm_slot;		// Wheel slot, while pending
+	uint8_t tm_cpu;			// Whose wheel
+};
+
+void	timer_init(void);
+void	timer_add(struct Timer *tm, uint64_t deadline,
+		  void (*func)(struct Timer *), void *arg);
+bool	timer_cancel(struct Timer *tm);
+void	timer_intr(void);
+void	timer_poll(void);
+void	timer_sleep(uint64_t ns);
+void	timer_print_stats(void);
+void	timer_stress(int ntimers);
+
+void	cpu_idle(void);
+
+#endif	// !JOS_KERN_TIMER_H
@@ -0,0 +1,356 @@
+#include <inc/mmu.h>
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/trap.h>
+#include <kern/console.h>
+#include <kern/monitor.h>
+#include <kern/syscall.h>
+#include <kern/cpu.h>
+#include <kern/timer.h>
+#include <kern/spinlock.h>
+#include <kern/fpu.h>
+
+// Global descriptor table.
+//
+// Set up global descriptor table (GDT) with separate segments for
+// kernel mode and user mode.  Segments serve many purposes on the x86.
+// We don't use any of their memory-mapping capabilities, but we need
+// them to switch privilege levels.
+//
+// The kernel and user segments are identical except for the DPL.
+// To load the SS register, the CPL must equal the DPL.  Thus,
+// we must duplicate the segments for the user and the kernel.
+//
+// sysenter and sysexit find the other three segments at fixed offsets
+// from the kernel code segment, so this order is not negotiable.
+//
+// In particular, the last argument to the SEG macro used in the
+// definition of gdt specifies the Descriptor Privilege Level (DPL)
+// of that descriptor: 0 for kernel and 3 for user.
+//
+struct Segdesc gdt[2 * NCPU + 5] =
+{
+	// 0x0 - unused (always faults -- for trapping NULL far pointers)
+	SEG_NULL,
+
+	// 0x8 - kernel code segment
+	[GD_KT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 0),
+
+	// 0x10 - kernel data segment
+	[GD_KD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 0),
+
+	// 0x18 - user code segment
+	[GD_UT >> 3] = SEG(STA_X | STA_R, 0x0, 0xffffffff, 3),
+
+	// 0x20 - user data segment
+	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
+
+	// Per-CPU TSS descriptors (starting from GD_TSS0) are initialized
+	// in trap_init_percpu()
+	[GD_TSS0 >> 3] = SEG_NULL,
+
+	// Per-CPU data segments (starting from GD_PCPU0) are initialized
+	// in gdt_init_percpu()
+	[GD_PCPU0 >> 3] = SEG_NULL
+};
+
+struct Pseudodesc gdt_pd = {
+	sizeof(gdt) - 1, (unsigned long) gdt
+};
+
+/* Interrupt descriptor table.  (Must be built at run time because
+ * shifted function addresses can't be represented in relocation records.)
+ */
+struct Gatedesc idt[256] = { { 0 } };
+struct Pseudodesc idt_pd = {
+	sizeof(idt) - 1, (uint32_t) idt
+};
+
+// Each CPU's stack for traps from user mode, which its task state
+// segment in struct CpuInfo points to.
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+	__attribute__ ((aligned(PGSIZE)));
+
+
+static const char *trapname(int trapno)
+{
+	static const char * const excnames[] = {
+		"Divide error",
+		"Debug",
+		"Non-Maskable Interrupt",
+		"Breakpoint",
+		"Overflow",
+		"BOUND Range Exceeded",
+		"Invalid Opcode",
+		"Device Not Available",
+		"Double Fault",
+		"Coprocessor Segment Overrun",
+		"Invalid TSS",
+		"Segment Not Present",
+		"Stack Fault",
+		"General Protection",
+		"Page Fault",
+		"(unknown trap)",
+		"x87 FPU Floating-Point Error",
+		"Alignment Check",
+		"Machine-Check",
+		"SIMD Floating-Point Exception"
+	};
+
+	if (trapno < ARRAY_SIZE(excnames))
+		return excnames[trapno];
+	if (trapno == T_SYSCALL)
+		return "System call";
+	return "(unknown trap)";
+}
+
+
+void
+trap_init(void)
+{
+	extern void t_divide(), t_debug(), t_nmi(), t_brkpt(), t_oflow();
+	extern void t_bound(), t_illop(), t_device(), t_dblflt(), t_tss();
+	extern void t_segnp(), t_stack(), t_gpflt(), t_pgflt(), t_fperr();
+	extern void t_align(), t_mchk(), t_simderr(), t_syscall();
+	extern void irq_timer(), irq_kbd(), irq_serial(), irq_spurious();
+	extern void irq_error(), irq_wakeup();
+
+	// All interrupt gates, so that the kernel runs with interrupts
+	// off.  Only breakpoints and system calls may come from user mode.
+	SETGATE(idt[T_DIVIDE], 0, GD_KT, t_divide, 0);
+	SETGATE(idt[T_DEBUG], 0, GD_KT, t_debug, 0);
+	SETGATE(idt[T_NMI], 0, GD_KT, t_nmi, 0);
+	SETGATE(idt[T_BRKPT], 0, GD_KT, t_brkpt, 3);
+	SETGATE(idt[T_OFLOW], 0, GD_KT, t_oflow, 0);
+	SETGATE(idt[T_BOUND], 0, GD_KT, t_bound, 0);
+	SETGATE(idt[T_ILLOP], 0, GD_KT, t_illop, 0);
+	SETGATE(idt[T_DEVICE], 0, GD_KT, t_device, 0);
+	SETGATE(idt[T_DBLFLT], 0, GD_KT, t_dblflt, 0);
+	SETGATE(idt[T_TSS], 0, GD_KT, t_tss, 0);
+	SETGATE(idt[T_SEGNP], 0, GD_KT, t_segnp, 0);
+	SETGATE(idt[T_STACK], 0, GD_KT, t_stack, 0);
+	SETGATE(idt[T_GPFLT], 0, GD_KT, t_gpflt, 0);
+	SETGATE(idt[T_PGFLT], 0, GD_KT, t_pgflt, 0);
+	SETGATE(idt[T_FPERR], 0, GD_KT, t_fperr, 0);
+	SETGATE(idt[T_ALIGN], 0, GD_KT, t_align, 0);
+	SETGATE(idt[T_MCHK], 0, GD_KT, t_mchk, 0);
+	SETGATE(idt[T_SIMDERR], 0, GD_KT, t_simderr, 0);
+	SETGATE(idt[T_SYSCALL], 0, GD_KT, t_syscall, 3);
+
+	// Device interrupts.  The kernel only takes these in cpu_idle().
+	SETGATE(idt[IRQ_OFFSET + IRQ_TIMER], 0, GD_KT, irq_timer, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_KBD], 0, GD_KT, irq_kbd, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT, irq_serial, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, irq_spurious, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, irq_error, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_WAKEUP], 0, GD_KT, irq_wakeup, 0);
+
+	// Per-CPU setup
+	trap_init_percpu();
+}
+
+// Load the GDT on this CPU, which is cpus[i], with %fs mapping its
+// struct CpuInfo.  From then on cpunum() and thiscpu work.  The BSP
+// calls this as soon as the BSS is clear; an AP, once it can read its
+// LAPIC ID.
+void
+gdt_init_percpu(int i)
+{
+	static_assert(GD_PCPU0 == GD_TSS0 + (NCPU << 3));
+
+	cpus[i].cpu_self = &cpus[i];
+	gdt[(GD_PCPU0 >> 3) + i] = SEG16(STA_W, (uint32_t) &cpus[i],
+					 sizeof(struct CpuInfo) - 1, 0);
+
+	lgdt(&gdt_pd);
+	// The kernel never uses GS, so we leave it set to the user data
+	// segment.
+	asm volatile("movw %%ax,%%gs" : : "a" (GD_UD|3));
+	// FS holds this CPU's data segment.  Returning to user mode
+	// clears it, so trapentry.S loads it again on the way in.
+	asm volatile("movw %%ax,%%fs" : : "a" (GD_PCPU0 + (i << 3)));
+	// The kernel does use ES, DS, and SS.  We'll change between
+	// the kernel and user data segments as needed.
+	asm volatile("movw %%ax,%%es" : : "a" (GD_KD));
+	asm volatile("movw %%ax,%%ds" : : "a" (GD_KD));
+	asm volatile("movw %%ax,%%ss" : : "a" (GD_KD));
+	// Load the kernel text segment into CS.
+	asm volatile("ljmp %0,$1f\n 1:\n" : : "i" (GD_KT));
+	// For good measure, clear the local descriptor table (LDT),
+	// since we don't use it.
+	lldt(0);
+}
+
+// Load a TSS and the IDT on this CPU, and point sysenter at the kernel.
+void
+trap_init_percpu(void)
+{
+	extern void sysenter_entry();
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+	int i = cpunum();
+	uintptr_t kstacktop = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
+	uint32_t edx;
+
+	// Setup a TSS so that we get the right stack
+	// when we trap to the kernel.
+	ts->ts_esp0 = kstacktop;
+	ts->ts_ss0 = GD_KD;
+	ts->ts_iomb = sizeof(struct Taskstate);
+
+	// Initialize the TSS slot of the gdt.
+	gdt[(GD_TSS0 >> 3) + i] = SEG16(STS_T32A, (uint32_t) ts,
+					sizeof(struct Taskstate) - 1, 0);
+	gdt[(GD_TSS0 >> 3) + i].sd_s = 0;
+
+	// Load the TSS selector (like other segment selectors, the
+	// bottom three bits are special; we leave them 0)
+	ltr(GD_TSS0 + (i << 3));
+
+	// Load the IDT
+	lidt(&idt_pd);
+
+	// sysenter enters the kernel at sysenter_entry, on the same stack
+	// as a trap from user mode.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_EDX_SEP) {
+		wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_IA32_SYSENTER_ESP, kstacktop);
+		wrmsr(MSR_IA32_SYSENTER_EIP, (uintptr_t) sysenter_entry);
+	}
+}
+
+void
+print_trapframe(struct Trapframe *tf)
+{
+	cprintf("TRAP frame at %p\n", tf);
+	print_regs(&tf->tf_regs);
+	cprintf("  es   0x----%04x\n", tf->tf_es);
+	cprintf("  ds   0x----%04x\n", tf->tf_ds);
+	cprintf("  trap 0x%08x %s\n", tf->tf_trapno, trapname(tf->tf_trapno));
+	// If this trap was a page fault that just happened
+	// (so %cr2 is meaningful), print the faulting linear address.
+	if (tf->tf_trapno == T_PGFLT)
+		cprintf("  cr2  0x%08x\n", rcr2());
+	cprintf("  err  0x%08x", tf->tf_err);
+	// For page faults, print decoded fault error code:
+	// U/K=fault occurred in user/kernel mode
+	// W/R=a write/read caused the fault
+	// PR=a protection violation caused the fault (NP=page not present).
+	if (tf->tf_trapno == T_PGFLT)
+		cprintf(" [%s, %s, %s]\n",
+			tf->tf_err & 4 ? "user" : "kernel",
+			tf->tf_err & 2 ? "write" : "read",
+			tf->tf_err & 1 ? "protection" : "not-present");
+	else
+		cprintf("\n");
+	cprintf("  eip  0x%08x\n", tf->tf_eip);
+	cprintf("  cs   0x----%04x\n", tf->tf_cs);
+	cprintf("  flag 0x%08x\n", tf->tf_eflags);
+	if ((tf->tf_cs & 3) != 0) {
+		cprintf("  esp  0x%08x\n", tf->tf_esp);
+		cprintf("  ss   0x----%04x\n", tf->tf_ss);
+	}
+}
+
+void
+print_regs(struct PushRegs *regs)
+{
+	cprintf("  edi  0x%08x\n", regs->reg_edi);
+	cprintf("  esi  0x%08x\n", regs->reg_esi);
+	cprintf("  ebp  0x%08x\n", regs->reg_ebp);
+	cprintf("  oesp 0x%08x\n", regs->reg_oesp);
+	cprintf("  ebx  0x%08x\n", regs->reg_ebx);
+	cprintf("  edx  0x%08x\n", regs->reg_edx);
+	cprintf("  ecx  0x%08x\n", regs->reg_ecx);
+	cprintf("  eax  0x%08x\n", regs->reg_eax);
+}
+
+static void
+trap_dispatch(struct Trapframe *tf)
+{
+	switch (tf->tf_trapno) {
+	case T_SYSCALL:
+		tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax,
+					      tf->tf_regs.reg_edx,
+					      tf->tf_regs.reg_ecx,
+					      tf->tf_regs.reg_ebx,
+					      tf->tf_regs.reg_edi,
+					      tf->tf_regs.reg_esi);
+		return;
+	case T_DEVICE:
+		fpu_trap();
+		return;
+	case T_BRKPT:
+		if ((tf->tf_cs & 3) == 0) {
+			monitor(tf);
+			return;
+		}
+		break;
+
+	// The 8259A runs in automatic-EOI mode, so only the LAPIC's own
+	// interrupts need an EOI.
+	case IRQ_OFFSET + IRQ_TIMER:
+		lapic_eoi();
+		timer_intr();
+		return;
+	case IRQ_OFFSET + IRQ_KBD:
+		kbd_intr();
+		return;
+	case IRQ_OFFSET + IRQ_SERIAL:
+		serial_intr();
+		return;
+	case IRQ_OFFSET + IRQ_SPURIOUS:
+		// Handle spurious interrupts
+		// The hardware sometimes raises these because of noise on the
+		// IRQ line or other reasons. We don't care.
+		cprintf("Spurious interrupt on irq 7\n");
+		print_trapframe(tf);
+		return;
+	case IRQ_OFFSET + IRQ_ERROR:
+		lapic_eoi();
+		return;
+	case IRQ_OFFSET + IRQ_WAKEUP:
+		// Nothing to do: the CPU was woken from cpu_idle().
+		lapic_eoi();
+		return;
+	}
+
+	// There are no environments yet: user code only runs under
+	// user_run(), and any other trap from it hands control back.
+	if ((tf->tf_cs & 3) == 3)
+		user_return(tf->tf_trapno);
+
+	// Unexpected trap: the kernel has a bug.
+	print_trapframe(tf);
+	panic("unhandled trap in kernel");
+}
+
+void
+trap(struct Trapframe *tf)
+{
+	// The environment may have set DF and some versions
+	// of GCC rely on DF being clear
+	asm volatile("cld" ::: "cc");
+
+	// Check that interrupts are disabled.  If this assertion
+	// fails, DO NOT be tempted to fix it by inserting a "cli" in
+	// the interrupt path.
+	assert(!(read_eflags() & FL_IF));
+
+	// Halted in cpu_idle(), the CPU had let go of the big kernel
+	// lock.  Reacquire it to handle the interrupt that woke it, and
+	// let go again: until cpu_idle() gets to its cli, another
+	// interrupt may come in the same way.
+	if (thiscpu->cpu_status == CPU_HALTED) {
+		lock_kernel();
+		trap_dispatch(tf);
+		unlock_kernel();
+		return;
+	}
+
+	// Dispatch based on what type of trap occurred.  If that returns,
+	// trapentry.S goes back to where the trap came from.
+	trap_dispatch(tf);
+}
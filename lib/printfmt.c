@@ -80,18 +80,25 @@ getint(va_list *ap, int lflag)
 void printfmt(void (*putch)(int, void*), void *putdat, const char *fmt, ...);
 
 void
-vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list ap)
+vprintfmt(void (*putch)(int, void*), void *putdat, const char *fmt, va_list args)
 {
 	register const char *p;
 	register int ch, err;
 	unsigned long long num;
 	int base, lflag, width, precision, altflag;
 	char padc;
+	va_list ap;
+
+	// Work on a copy so that &ap really is a va_list pointer, even where
+	// va_list is an array type (as in x86-64 host builds of this file).
+	va_copy(ap, args);
 
 	while (1) {
 		while ((ch = *(unsigned char *) fmt++) != '%') {
-			if (ch == '\0')
+			if (ch == '\0') {
+				va_end(ap);
 				return;
+			}
 			putch(ch, putdat);
 		}
 
@@ -8,24 +8,47 @@
 // Primespipe runs 3x faster this way.
 #define ASM 1
 
+// strlen and friends scan a word at a time once the pointer is aligned.
+// An aligned word never straddles a page boundary, so reading the bytes
+// beyond a string's terminator within its last word is always safe.
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+
+#define ONES	0x01010101U
+#define HIGHS	0x80808080U
+
+// Nonzero if any byte of word 'w' is zero.
+#define HASZERO(w)	(((w) - ONES) & ~(w) & HIGHS)
+
 int
 strlen(const char *s)
 {
-	int n;
+	const char *p;
+	const word_t *w;
 
-	for (n = 0; *s != '\0'; s++)
-		n++;
-	return n;
+	for (p = s; (uintptr_t) p % 4 != 0; p++)
+		if (*p == '\0')
+			return p - s;
+	for (w = (const word_t *) p; !HASZERO(*w); w++)
+		/* do nothing */;
+	for (p = (const char *) w; *p != '\0'; p++)
+		/* do nothing */;
+	return p - s;
 }
 
 int
 strnlen(const char *s, size_t size)
 {
-	int n;
-
-	for (n = 0; size > 0 && *s != '\0'; s++, size--)
-		n++;
-	return n;
+	const char *p;
+	const word_t *w;
+
+	for (p = s; size > 0 && (uintptr_t) p % 4 != 0; p++, size--)
+		if (*p == '\0')
+			return p - s;
+	for (w = (const word_t *) p; size >= 4 && !HASZERO(*w); w++)
+		size -= 4;
+	for (p = (const char *) w; size > 0 && *p != '\0'; p++, size--)
+		/* do nothing */;
+	return p - s;
 }
 
 char *
@@ -95,15 +118,32 @@ strncmp(const char *p, const char *q, size_t n)
 		return (int) ((unsigned char) *p - (unsigned char) *q);
 }
 
+// Return a pointer to the first byte of 's' that is either 'c' or the
+// string-ending null character.
+static const char *
+strscan(const char *s, char c)
+{
+	const word_t *w;
+	uint32_t cs;
+
+	for (; (uintptr_t) s % 4 != 0; s++)
+		if (*s == c || *s == '\0')
+			return s;
+	cs = (uint8_t) c * ONES;
+	for (w = (const word_t *) s; !HASZERO(*w) && !HASZERO(*w ^ cs); w++)
+		/* do nothing */;
+	for (s = (const char *) w; *s != c && *s != '\0'; s++)
+		/* do nothing */;
+	return s;
+}
+
 // Return a pointer to the first occurrence of 'c' in 's',
 // or a null pointer if the string has no 'c'.
 char *
 strchr(const char *s, char c)
 {
-	for (; *s; s++)
-		if (*s == c)
-			return (char *) s;
-	return 0;
+	s = strscan(s, c);
+	return *s ? (char *) s : 0;
 }
 
 // Return a pointer to the first occurrence of 'c' in 's',
@@ -111,65 +151,195 @@ strchr(const char *s, char c)
 char *
 strfind(const char *s, char c)
 {
-	for (; *s; s++)
-		if (*s == c)
-			break;
-	return (char *) s;
+	return (char *) strscan(s, c);
 }
 
 #if ASM
+// memset, memcpy and memmove choose how to move the bytes by size class,
+// from the table below.  These defaults suit QEMU and older CPUs; the
+// kernel overwrites them after timing each strategy at boot.
+struct String_tunables string_tunables = {
+	.st_copy = { STR_WORDS, STR_WORDS, STR_WORDS },
+	.st_set = { STR_WORDS, STR_WORDS, STR_WORDS },
+};
+
+// With STR_WORDS, memset, memcpy and memmove store single bytes until the
+// destination is word-aligned, do the bulk of the work with a
+// word-at-a-time string instruction, and finish the last few bytes
+// singly.  That way odd sizes and offsets cost little more than aligned
+// ones.
 void *
 memset(void *v, int c, size_t n)
 {
 	char *p;
+	size_t m;
 
-	if (n == 0)
-		return v;
-	if ((int)v%4 == 0 && n%4 == 0) {
+	p = v;
+	if (n >= STR_SMALL) {
+		switch (string_tunables.st_set[STR_CLASS(n)]) {
+		case STR_BULK:
+			if (c == 0 && string_tunables.st_bulk_zero) {
+				string_tunables.st_bulk_zero(v, n);
+				return v;
+			}
+			break;
+		case STR_BYTES:
+			asm volatile("cld; rep stosb\n"
+				: "+D" (p), "+c" (n) : "a" (c)
+				: "cc", "memory");
+			return v;
+		}
+		for (; (uintptr_t)p % 4 != 0; n--)
+			*p++ = c;
+		m = n / 4;
+		n %= 4;
 		c &= 0xFF;
-		c = (c<<24)|(c<<16)|(c<<8)|c;
 		asm volatile("cld; rep stosl\n"
-			:: "D" (v), "a" (c), "c" (n/4)
-			: "cc", "memory");
-	} else
-		asm volatile("cld; rep stosb\n"
-			:: "D" (v), "a" (c), "c" (n)
+			: "+D" (p), "+c" (m) : "a" ((uint32_t) c * ONES)
 			: "cc", "memory");
+	}
+	for (; n > 0; n--)
+		*p++ = c;
 	return v;
 }
 
+// Only the destination is aligned; if the source is a different distance
+// from a word boundary, rep movsl reads it misaligned, which still beats
+// moving single bytes on CPUs without fast rep movsb.  memmove never
+// uses STR_BULK, whose implementations only copy forwards.
 void *
 memmove(void *dst, const void *src, size_t n)
 {
 	const char *s;
 	char *d;
+	size_t m;
+	bool words;
 
 	s = src;
 	d = dst;
+	words = n >= STR_SMALL
+		&& string_tunables.st_copy[STR_CLASS(n)] != STR_BYTES;
 	if (s < d && s + n > d) {
+		// Overlapping with the destination above the source,
+		// so copy backwards from the end.
 		s += n;
 		d += n;
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("std; rep movsl\n"
-				:: "D" (d-4), "S" (s-4), "c" (n/4) : "cc", "memory");
-		else
-			asm volatile("std; rep movsb\n"
-				:: "D" (d-1), "S" (s-1), "c" (n) : "cc", "memory");
-		// Some versions of GCC rely on DF being clear
-		asm volatile("cld" ::: "cc");
+		if (!words) {
+			// rep leaves %edi, %esi and %ecx changed, so they
+			// are outputs too.  Some versions of GCC rely on DF
+			// being clear.
+			d--;
+			s--;
+			asm volatile("std; rep movsb; cld\n"
+				: "+D" (d), "+S" (s), "+c" (n)
+				: : "cc", "memory");
+			return dst;
+		}
+		for (; (uintptr_t)d % 4 != 0; n--)
+			*--d = *--s;
+		m = n / 4;
+		n %= 4;
+		d -= 4;
+		s -= 4;
+		asm volatile("std; rep movsl; cld\n"
+			: "+D" (d), "+S" (s), "+c" (m)
+			: : "cc", "memory");
+		d += 4;
+		s += 4;
+		while (n-- > 0)
+			*--d = *--s;
 	} else {
-		if ((int)s%4 == 0 && (int)d%4 == 0 && n%4 == 0)
-			asm volatile("cld; rep movsl\n"
-				:: "D" (d), "S" (s), "c" (n/4) : "cc", "memory");
-		else
+		if (!words) {
 			asm volatile("cld; rep movsb\n"
-				:: "D" (d), "S" (s), "c" (n) : "cc", "memory");
+				: "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+			return dst;
+		}
+		for (; (uintptr_t)d % 4 != 0; n--)
+			*d++ = *s++;
+		m = n / 4;
+		n %= 4;
+		asm volatile("cld; rep movsl\n"
+			: "+D" (d), "+S" (s), "+c" (m) : : "cc", "memory");
+		while (n-- > 0)
+			*d++ = *s++;
 	}
 	return dst;
 }
 
+// Like memmove, but the buffers can't overlap, so memcpy only ever copies
+// forwards and skips the overlap test.  Short copies don't pay for
+// starting up a rep instruction.  The parentheses keep the name from
+// expanding as the inline macro in inc/string.h.
+void *
+(memcpy)(void *dst, const void *src, size_t n)
+{
+	const char *s;
+	char *d;
+	size_t m;
+
+	s = src;
+	d = dst;
+	if (n >= STR_SMALL) {
+		switch (string_tunables.st_copy[STR_CLASS(n)]) {
+		case STR_BULK:
+			if (string_tunables.st_bulk_copy) {
+				string_tunables.st_bulk_copy(dst, src, n);
+				return dst;
+			}
+			break;
+		case STR_BYTES:
+			asm volatile("cld; rep movsb\n"
+				: "+D" (d), "+S" (s), "+c" (n) : : "cc", "memory");
+			return dst;
+		}
+		for (; (uintptr_t)d % 4 != 0; n--)
+			*d++ = *s++;
+		m = n / 4;
+		n %= 4;
+		asm volatile("cld; rep movsl\n"
+			: "+D" (d), "+S" (s), "+c" (m) : : "cc", "memory");
+	}
+	while (n-- > 0)
+		*d++ = *s++;
+	return dst;
+}
+
+// Compare single bytes until v1 is word-aligned, then let repe cmpsl
+// find the first differing word, and finish bytewise within it.
+int
+memcmp(const void *v1, const void *v2, size_t n)
+{
+	const uint8_t *s1 = (const uint8_t *) v1;
+	const uint8_t *s2 = (const uint8_t *) v2;
+	size_t m;
+	uint8_t ne;
+
+	if (n >= STR_SMALL) {
+		for (; (uintptr_t) s1 % 4 != 0; n--, s1++, s2++)
+			if (*s1 != *s2)
+				return (int) *s1 - (int) *s2;
+		m = n / 4;
+		asm volatile("cld; repe cmpsl; setne %3\n"
+			: "+S" (s1), "+D" (s2), "+c" (m), "=q" (ne)
+			: : "cc", "memory");
+		if (ne) {
+			s1 -= 4;
+			s2 -= 4;
+			n = 4;
+		} else
+			n %= 4;
+	}
+	for (; n > 0; n--, s1++, s2++)
+		if (*s1 != *s2)
+			return (int) *s1 - (int) *s2;
+	return 0;
+}
+
 #else
 
+// The C versions ignore the table, but it must still exist.
+struct String_tunables string_tunables;
+
 void *
 memset(void *v, int c, size_t n)
 {
@@ -203,12 +373,19 @@ memmove(void *dst, const void *src, size_t n)
 
 	return dst;
 }
-#endif
 
 void *
-memcpy(void *dst, const void *src, size_t n)
+(memcpy)(void *dst, const void *src, size_t n)
 {
-	return memmove(dst, src, n);
+	const char *s;
+	char *d;
+
+	s = src;
+	d = dst;
+	while (n-- > 0)
+		*d++ = *s++;
+
+	return dst;
 }
 
 int
@@ -226,14 +403,24 @@ memcmp(const void *v1, const void *v2, size_t n)
 	return 0;
 }
 
+#endif
+
 void *
 memfind(const void *s, int c, size_t n)
 {
-	const void *ends = (const char *) s + n;
-	for (; s < ends; s++)
-		if (*(const unsigned char *) s == (unsigned char) c)
-			break;
-	return (void *) s;
+	const uint8_t *p = s;
+	const word_t *w;
+	uint32_t cs;
+
+	for (; n > 0 && (uintptr_t) p % 4 != 0; p++, n--)
+		if (*p == (uint8_t) c)
+			return (void *) p;
+	cs = (uint8_t) c * ONES;
+	for (w = (const word_t *) p; n >= 4 && !HASZERO(*w ^ cs); w++)
+		n -= 4;
+	for (p = (const uint8_t *) w; n > 0 && *p != (uint8_t) c; p++, n--)
+		/* do nothing */;
+	return (void *) p;
 }
 
 long
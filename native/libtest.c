@@ -0,0 +1,627 @@
+// Host-native tests, fuzzing and benchmarks for lib/string.c and
+// lib/printfmt.c.
+//
+// native/Makefrag compiles those files for the host and prefixes every
+// symbol they define with jos_, so this program can call the JOS
+// routines and glibc's side by side.  Usage:
+//
+//	libtest [test] [fuzz [iterations]] [bench]
+//
+// 'test' checks the string routines against glibc across sizes,
+// alignments, overlaps and page boundaries; 'fuzz' differentially tests
+// vsnprintf and strtol on random inputs both implementations agree on;
+// 'bench' prints JOS-vs-glibc throughput across sizes and alignments.
+//
+// The kernel is i386, so native/Makefrag builds this with -m32 when the
+// host can link 32-bit programs (on Debian and Ubuntu, with gcc-multilib
+// installed).  Otherwise it falls back to the host's LP64 ABI: JOS's
+// size_t is still 32 bits, but pointers and uintptr_t are 64, so the
+// routines run different code for pointer arithmetic than the kernel
+// does.  'test' says which build it is.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The JOS routines, as renamed by native/Makefrag.  JOS's size_t is
+// 32 bits wide.
+void *	jos_memset(void *dst, int c, uint32_t len);
+void *	jos_memcpy(void *dst, const void *src, uint32_t len);
+void *	jos_memmove(void *dst, const void *src, uint32_t len);
+int	jos_memcmp(const void *s1, const void *s2, uint32_t len);
+void *	jos_memfind(const void *s, int c, uint32_t len);
+int	jos_strlen(const char *s);
+int	jos_strnlen(const char *s, uint32_t size);
+char *	jos_strchr(const char *s, char c);
+char *	jos_strfind(const char *s, char c);
+int	jos_strcmp(const char *s1, const char *s2);
+int	jos_strncmp(const char *s1, const char *s2, uint32_t size);
+long	jos_strtol(const char *s, char **endptr, int base);
+int	jos_vsnprintf(char *str, int size, const char *fmt, va_list ap);
+
+// string_tunables, through native/tunables.c, which sees the real
+// struct String_tunables.
+int	jos_tunables_nstrategy(void);
+void	jos_tunables_force(int how,
+			   void (*bulk_copy)(void *, const void *, uint32_t),
+			   void (*bulk_zero)(void *, uint32_t));
+void	jos_tunables_restore(void);
+
+#define BUFSIZE		(1 << 20)
+#define MAXALIGN	8
+
+static uint8_t *buf1, *buf2, *ref1, *ref2;
+static int failures;
+
+#define check(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			if (failures++ < 20) {				\
+				printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+				printf(__VA_ARGS__);			\
+				printf("\n");				\
+			}						\
+		}							\
+	} while (0)
+
+static int
+sign(int x)
+{
+	return (x > 0) - (x < 0);
+}
+
+// xorshift32; deterministic so that failures can be reproduced.
+static uint32_t rand_state = 6828;
+
+static uint32_t
+rnd(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static void
+fill(uint8_t *a, uint8_t *b, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		a[i] = b[i] = rnd() | 1;
+}
+
+
+/***** Correctness tests *****/
+
+// Lengths to test: every small length, then a few around page sizes.
+static const size_t test_lens[] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17,
+	23, 31, 32, 33, 63, 64, 65, 127, 128, 129, 255, 256, 257,
+	1000, 4095, 4096, 4097, 8191, 8192, 8193, 65537
+};
+
+static void
+test_memset(void)
+{
+	size_t i, n;
+	int a;
+
+	for (i = 0; i < sizeof(test_lens) / sizeof(test_lens[0]); i++)
+		for (a = 0; a < MAXALIGN; a++) {
+			n = test_lens[i];
+			fill(buf1, ref1, n + 2 * MAXALIGN);
+			jos_memset(buf1 + a, 0xa5 + a, n);
+			memset(ref1 + a, 0xa5 + a, n);
+			check(memcmp(buf1, ref1, n + 2 * MAXALIGN) == 0,
+			      "memset len %zu align %d", n, a);
+		}
+}
+
+static void
+test_memcpy(void)
+{
+	size_t i, n;
+	int sa, da;
+
+	for (i = 0; i < sizeof(test_lens) / sizeof(test_lens[0]); i++)
+		for (sa = 0; sa < MAXALIGN; sa++)
+			for (da = 0; da < MAXALIGN; da++) {
+				n = test_lens[i];
+				fill(buf1, ref1, n + 2 * MAXALIGN);
+				fill(buf2, ref2, n + 2 * MAXALIGN);
+				check(jos_memcpy(buf1 + da, buf2 + sa, n) == buf1 + da,
+				      "memcpy return value");
+				memcpy(ref1 + da, ref2 + sa, n);
+				check(memcmp(buf1, ref1, n + 2 * MAXALIGN) == 0,
+				      "memcpy len %zu src align %d dst align %d",
+				      n, sa, da);
+				jos_memmove(buf1 + da, buf2 + sa, n);
+				memmove(ref1 + da, ref2 + sa, n);
+				check(memcmp(buf1, ref1, n + 2 * MAXALIGN) == 0,
+				      "memmove len %zu src align %d dst align %d",
+				      n, sa, da);
+			}
+}
+
+static void
+test_memmove_overlap(void)
+{
+	size_t i, n;
+	int a, off;
+
+	for (i = 0; i < sizeof(test_lens) / sizeof(test_lens[0]); i++)
+		for (a = 0; a < MAXALIGN; a++)
+			for (off = -9; off <= 9; off++) {
+				n = test_lens[i];
+				fill(buf1, ref1, n + 4 * MAXALIGN);
+				jos_memmove(buf1 + 2 * MAXALIGN + a + off,
+					    buf1 + 2 * MAXALIGN + a, n);
+				memmove(ref1 + 2 * MAXALIGN + a + off,
+					ref1 + 2 * MAXALIGN + a, n);
+				check(memcmp(buf1, ref1, n + 4 * MAXALIGN) == 0,
+				      "memmove overlap len %zu align %d offset %d",
+				      n, a, off);
+			}
+}
+
+// Stand-ins for the kernel's bulk routines, which have to go through
+// the JOS versions of memcpy and memset for their head and tail.
+static void
+test_bulk_copy(void *dst, const void *src, uint32_t len)
+{
+	memcpy(dst, src, len);
+}
+
+static void
+test_bulk_zero(void *dst, uint32_t len)
+{
+	memset(dst, 0, len);
+}
+
+// Run the memset, memcpy and memmove tests with each strategy in turn
+// forced for every size class.
+static void
+test_strategies(void)
+{
+	int how;
+
+	for (how = 0; how < jos_tunables_nstrategy(); how++) {
+		jos_tunables_force(how, test_bulk_copy, test_bulk_zero);
+		test_memset();
+		test_memcpy();
+		test_memmove_overlap();
+	}
+	jos_tunables_restore();
+}
+
+static void
+test_memcmp(void)
+{
+	size_t i, n, pos;
+	int sa, da;
+
+	for (i = 0; i < sizeof(test_lens) / sizeof(test_lens[0]); i++)
+		for (sa = 0; sa < MAXALIGN; sa++)
+			for (da = 0; da < MAXALIGN; da += 3) {
+				n = test_lens[i];
+				fill(buf1 + sa, buf2 + da, n);
+				check(jos_memcmp(buf1 + sa, buf2 + da, n) == 0,
+				      "memcmp equal len %zu", n);
+				if (n == 0)
+					continue;
+				pos = rnd() % n;
+				buf1[sa + pos] ^= (rnd() % 255) + 1;
+				check(sign(jos_memcmp(buf1 + sa, buf2 + da, n)) ==
+				      sign(memcmp(buf1 + sa, buf2 + da, n)),
+				      "memcmp len %zu diff at %zu", n, pos);
+				check(jos_memcmp(buf1 + sa, buf2 + da, pos) == 0,
+				      "memcmp prefix len %zu", pos);
+			}
+}
+
+static void
+test_memfind(void)
+{
+	size_t i, n, pos;
+	int a;
+
+	for (i = 0; i < sizeof(test_lens) / sizeof(test_lens[0]); i++)
+		for (a = 0; a < MAXALIGN; a++) {
+			n = test_lens[i];
+			memset(buf1, 'x', n + MAXALIGN);
+			check(jos_memfind(buf1 + a, 'y', n) == buf1 + a + n,
+			      "memfind missing len %zu align %d", n, a);
+			if (n == 0)
+				continue;
+			pos = rnd() % n;
+			buf1[a + pos] = 'y';
+			check(jos_memfind(buf1 + a, 'y', n) == buf1 + a + pos,
+			      "memfind len %zu align %d pos %zu", n, a, pos);
+			buf1[a + pos] = 0x80 | 'y';
+			check(jos_memfind(buf1 + a, 0x80 | 'y', n) == buf1 + a + pos,
+			      "memfind high byte len %zu pos %zu", n, pos);
+		}
+}
+
+static void
+test_str(void)
+{
+	size_t i, n, pos;
+	int a;
+	char *s;
+
+	for (i = 0; i < sizeof(test_lens) / sizeof(test_lens[0]); i++)
+		for (a = 0; a < MAXALIGN; a++) {
+			n = test_lens[i];
+			s = (char *) buf1 + a;
+			memset(buf1, 'a', n + 2 * MAXALIGN);
+			s[n] = '\0';
+			check(jos_strlen(s) == (int) n, "strlen len %zu align %d",
+			      n, a);
+			check(jos_strnlen(s, n / 2) == (int) (n / 2),
+			      "strnlen len %zu limit %zu", n, n / 2);
+			check(jos_strnlen(s, n + 5) == (int) n,
+			      "strnlen len %zu limit %zu", n, n + 5);
+			check(jos_strchr(s, 'b') == NULL, "strchr missing");
+			check(jos_strchr(s, '\0') == NULL, "strchr NUL");
+			check(jos_strfind(s, 'b') == s + n, "strfind missing");
+			if (n == 0)
+				continue;
+			pos = rnd() % n;
+			s[pos] = 'b';
+			check(jos_strchr(s, 'b') == s + pos,
+			      "strchr len %zu align %d pos %zu", n, a, pos);
+			check(jos_strfind(s, 'b') == s + pos,
+			      "strfind len %zu align %d pos %zu", n, a, pos);
+			s[pos] = (char) 0xe2;
+			check(jos_strchr(s, (char) 0xe2) == s + pos,
+			      "strchr high byte pos %zu", pos);
+			memcpy(buf2, buf1, n + 2 * MAXALIGN);
+			check(jos_strcmp(s, (char *) buf2 + a) == 0, "strcmp equal");
+			((char *) buf2)[a + pos] = 'c';
+			check(sign(jos_strcmp(s, (char *) buf2 + a)) ==
+			      sign(strcmp(s, (char *) buf2 + a)), "strcmp order");
+			check(sign(jos_strncmp(s, (char *) buf2 + a, pos)) == 0,
+			      "strncmp prefix");
+		}
+}
+
+// Run the string scanners over strings that end at the very last byte
+// before an unmapped page, at every alignment, to catch over-reads.
+static void
+test_page_boundary(void)
+{
+	long pgsize = sysconf(_SC_PAGESIZE);
+	uint8_t *pg;
+	char *s;
+	int len;
+
+	pg = mmap(NULL, 2 * pgsize, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pg == MAP_FAILED || mprotect(pg + pgsize, pgsize, PROT_NONE) < 0) {
+		perror("mmap");
+		exit(1);
+	}
+	for (len = 0; len < 64; len++) {
+		memset(pg, 'a', pgsize);
+		s = (char *) pg + pgsize - len - 1;
+		s[len] = '\0';
+		check(jos_strlen(s) == len, "strlen at page end, len %d", len);
+		check(jos_strnlen(s, len + 100) == len, "strnlen at page end");
+		check(jos_strchr(s, 'b') == NULL, "strchr at page end");
+		check(jos_strfind(s, 'b') == s + len, "strfind at page end");
+		s = (char *) pg + pgsize - len;
+		check(jos_memfind(s, 'b', len) == s + len, "memfind at page end");
+		memcpy(buf1, s, len);
+		check(jos_memcmp(s, buf1, len) == 0, "memcmp at page end");
+	}
+	munmap(pg, 2 * pgsize);
+}
+
+
+/***** Differential fuzzing *****/
+
+static void
+rnd_string(char *s, int n, const char *alphabet)
+{
+	int i, k = strlen(alphabet);
+
+	for (i = 0; i < n; i++)
+		s[i] = alphabet[rnd() % k];
+	s[n] = '\0';
+}
+
+static int
+jos_snprintf_(char *str, int size, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = jos_vsnprintf(str, size, fmt, ap);
+	va_end(ap);
+	return r;
+}
+
+enum { ARG_INT, ARG_LONG, ARG_LLONG, ARG_STR, ARG_CHAR, ARG_PTR, ARG_NONE };
+
+// Build a format string with one conversion that JOS and glibc define
+// identically.  JOS pads negative numbers differently, so a width is
+// only used with non-negative values.
+static int
+rnd_format(char *fmt, long long *val)
+{
+	char conv, *f = fmt;
+	int kind, width = rnd() % 3 ? 0 : 1 + rnd() % 20;
+
+	rnd_string(f, rnd() % 6, "abc xyz-09=:");
+	f += strlen(f);
+	*f++ = '%';
+	*val = ((long long) rnd() << 32) | rnd();
+
+	switch (rnd() % 7) {
+	case 0: case 1: case 2:
+		conv = "duxo"[rnd() % 4];
+		kind = rnd() % 3;
+		if (kind == ARG_INT)
+			*val = (int) *val;
+		if (kind == ARG_LONG)
+			*val = (long) *val;
+		if (width && conv == 'd' && *val < 0)
+			*val = -(*val + 1);
+		if (width && rnd() % 2)
+			*f++ = '0';
+		if (width)
+			f += sprintf(f, "%d", width);
+		if (kind == ARG_LONG)
+			*f++ = 'l';
+		if (kind == ARG_LLONG)
+			f += sprintf(f, "ll");
+		*f++ = conv;
+		break;
+	case 3: case 4:
+		kind = ARG_STR;
+		if (rnd() % 2)
+			*f++ = '-';
+		if (width)
+			f += sprintf(f, "%d", width);
+		// JOS reads "%.0s" as a '0' flag, so the precision is >= 1.
+		if (rnd() % 2)
+			f += sprintf(f, ".%d", 1 + rnd() % 11);
+		*f++ = 's';
+		break;
+	case 5:
+		kind = rnd() % 2 ? ARG_CHAR : ARG_PTR;
+		*f++ = kind == ARG_CHAR ? 'c' : 'p';
+		*val = kind == ARG_CHAR ? 32 + rnd() % 95 : *val | 1;
+		break;
+	default:
+		kind = ARG_NONE;
+		*f++ = '%';
+		break;
+	}
+	*f = '\0';
+	rnd_string(f, rnd() % 6, "abc xyz-09=:");
+	return kind;
+}
+
+static void
+fuzz_vsnprintf(long iters)
+{
+	char fmt[64], str[32], out1[80], out2[80];
+	long long val;
+	long i;
+	int kind, size, r1, r2;
+
+	for (i = 0; i < iters; i++) {
+		kind = rnd_format(fmt, &val);
+		size = 1 + rnd() % sizeof(out1);
+		rnd_string(str, rnd() % 20, "JOS kernel monitor");
+		memset(out1, 0x55, sizeof(out1));
+		memset(out2, 0x55, sizeof(out2));
+		switch (kind) {
+#define BOTH(arg)							\
+		r1 = jos_snprintf_(out1, size, fmt, arg);		\
+		r2 = snprintf(out2, size, fmt, arg)
+		case ARG_INT:	BOTH((int) val); break;
+		case ARG_LONG:	BOTH((long) val); break;
+		case ARG_LLONG:	BOTH(val); break;
+		case ARG_STR:	BOTH(str); break;
+		case ARG_CHAR:	BOTH((int) val); break;
+		case ARG_PTR:	BOTH((void *) (uintptr_t) val); break;
+		default:	BOTH(0); break;
+#undef BOTH
+		}
+		check(r1 == r2 && memcmp(out1, out2, sizeof(out1)) == 0,
+		      "vsnprintf(size %d, \"%s\"): jos %d \"%s\", glibc %d \"%s\"",
+		      size, fmt, r1, out1, r2, out2);
+	}
+}
+
+static void
+fuzz_strtol(long iters)
+{
+	static const int bases[] = { 0, 2, 8, 10, 16, 36 };
+	static const char *digits = "0123456789abcdefghijklmnopqrstuvwxyz";
+	char s[64], *p, *end1, *end2;
+	long v1, v2, i;
+	int base, eff, n, j;
+
+	for (i = 0; i < iters; i++) {
+		base = bases[rnd() % 6];
+		p = s;
+		rnd_string(p, rnd() % 3, " \t");
+		p += strlen(p);
+		if (rnd() % 2)
+			*p++ = "+-"[rnd() % 2];
+
+		eff = base ? base : 10;
+		if ((base == 0 || base == 16) && rnd() % 2) {
+			p += sprintf(p, "0x");
+			eff = 16;
+		} else if (base == 0 && rnd() % 3 == 0) {
+			*p++ = '0';
+			eff = 8;
+		}
+		// Stay below 2^63 so overflow handling doesn't matter.
+		n = 1 + rnd() % (eff == 2 ? 60 : eff == 8 ? 20 : 12);
+		for (j = 0; j < n; j++)
+			*p++ = digits[rnd() % eff];
+		*p++ = "!, ;.\n"[rnd() % 6];
+		*p = '\0';
+
+		v1 = jos_strtol(s, &end1, base);
+		v2 = strtol(s, &end2, base);
+		check(v1 == v2 && end1 == end2,
+		      "strtol(\"%s\", %d): jos %ld end %td, glibc %ld end %td",
+		      s, base, v1, end1 - s, v2, end2 - s);
+	}
+}
+
+
+/***** Benchmarks *****/
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+enum { OP_MEMSET, OP_MEMCPY, OP_MEMMOVE, OP_MEMMOVE_BACK, OP_MEMCMP,
+       OP_STRLEN, OP_STRCHR, OP_MEMFIND, NOPS };
+static const char *op_names[NOPS] = {
+	"memset", "memcpy", "memmove", "memmove-back", "memcmp", "strlen",
+	"strchr", "memfind"
+};
+
+// Called through volatile pointers so gcc can't specialize glibc's
+// versions at the call site.
+static void *(*volatile g_memset)(void *, int, size_t) = memset;
+static void *(*volatile g_memcpy)(void *, const void *, size_t) = memcpy;
+static void *(*volatile g_memmove)(void *, const void *, size_t) = memmove;
+static int (*volatile g_memcmp)(const void *, const void *, size_t) = memcmp;
+static size_t (*volatile g_strlen)(const char *) = strlen;
+static char *(*volatile g_strchr)(const char *, int) = strchr;
+static void *(*volatile g_memchr)(const void *, int, size_t) = memchr;
+
+static double
+bench_op(int op, int jos, size_t n, int align)
+{
+	uint8_t *d = buf1 + align, *s = buf2;
+	long iters = 1 + (256L << 20) / (n + 64), i;
+	double t;
+
+	memset(buf2, 'a', n + 2 * MAXALIGN);
+	buf2[n] = '\0';
+	memcpy(buf1, buf2, n + 2 * MAXALIGN);
+	t = now();
+	for (i = 0; i < iters; i++) {
+		switch (op) {
+		case OP_MEMSET:
+			jos ? jos_memset(d, 0, n) : g_memset(d, 0, n);
+			break;
+		case OP_MEMCPY:
+			jos ? jos_memcpy(d, s, n) : g_memcpy(d, s, n);
+			break;
+		case OP_MEMMOVE:
+			jos ? jos_memmove(d, s, n) : g_memmove(d, s, n);
+			break;
+		case OP_MEMMOVE_BACK:
+			jos ? jos_memmove(s + 1, s, n) : g_memmove(s + 1, s, n);
+			break;
+		case OP_MEMCMP:
+			jos ? jos_memcmp(d, s, n) : g_memcmp(d, s, n);
+			break;
+		case OP_STRLEN:
+			jos ? jos_strlen((char *) d) : g_strlen((char *) d);
+			break;
+		// Neither finds a match, so both scan the whole buffer.
+		case OP_STRCHR:
+			jos ? jos_strchr((char *) d, 'b')
+			    : g_strchr((char *) d, 'b');
+			break;
+		case OP_MEMFIND:
+			// glibc has no memfind; memchr is the nearest thing.
+			jos ? jos_memfind(d, 'b', n) : g_memchr(d, 'b', n);
+			break;
+		}
+	}
+	t = now() - t;
+	return (double) n * iters / t / 1e6;
+}
+
+static void
+bench(void)
+{
+	static const size_t sizes[] = { 8, 64, 512, 4096, 65536, 1 << 19 };
+	static const int aligns[] = { 0, 1, 3 };
+	double j, g;
+	int op, si, ai;
+
+	printf("%-14s %8s %5s %12s %12s %7s\n", "op", "size", "align",
+	       "jos MB/s", "glibc MB/s", "ratio");
+	for (op = 0; op < NOPS; op++)
+		for (si = 0; si < sizeof(sizes) / sizeof(sizes[0]); si++)
+			for (ai = 0; ai < sizeof(aligns) / sizeof(aligns[0]); ai++) {
+				j = bench_op(op, 1, sizes[si], aligns[ai]);
+				g = bench_op(op, 0, sizes[si], aligns[ai]);
+				printf("%-14s %8zu %5d %12.0f %12.0f %7.2f\n",
+				       op_names[op], sizes[si], aligns[ai],
+				       j, g, j / g);
+			}
+}
+
+
+int
+main(int argc, char **argv)
+{
+	long iters;
+	int i;
+
+	buf1 = aligned_alloc(4096, BUFSIZE + 4096);
+	buf2 = aligned_alloc(4096, BUFSIZE + 4096);
+	ref1 = aligned_alloc(4096, BUFSIZE + 4096);
+	ref2 = aligned_alloc(4096, BUFSIZE + 4096);
+
+	if (argc < 2) {
+		static char *defaults[] = { "libtest", "test", "fuzz", NULL };
+		argv = defaults;
+		argc = 3;
+	}
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "test") == 0) {
+			test_strategies();
+			test_memcmp();
+			test_memfind();
+			test_str();
+			test_page_boundary();
+			printf("string tests (%d-bit): %s\n",
+			       (int) sizeof(void *) * 8, failures ? "FAIL" : "OK");
+		} else if (strcmp(argv[i], "fuzz") == 0) {
+			iters = 200000;
+			if (i + 1 < argc && argv[i + 1][0] >= '0' &&
+			    argv[i + 1][0] <= '9')
+				iters = strtol(argv[++i], NULL, 0);
+			fuzz_vsnprintf(iters);
+			fuzz_strtol(iters);
+			printf("fuzz (%ld iterations): %s\n", iters,
+			       failures ? "FAIL" : "OK");
+		} else if (strcmp(argv[i], "bench") == 0)
+			bench();
+		else {
+			fprintf(stderr, "usage: %s [test] [fuzz [iterations]] [bench]\n",
+				argv[0]);
+			return 2;
+		}
+	}
+	return failures ? 1 : 0;
+}
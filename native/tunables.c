@@ -0,0 +1,45 @@
+// libtest.c's access to lib/string.c's string_tunables.
+//
+// libtest.c includes the host's headers, so it cannot include
+// inc/string.h as well.  This file is compiled like lib/string.c instead,
+// freestanding against the real struct String_tunables, and its symbols
+// get the same jos_ prefix, so libtest.c needs no copy of the struct that
+// could drift out of step with it.
+
+#include <inc/string.h>
+
+static struct String_tunables saved;
+static bool saved_valid;
+
+// Number of strategies tunables_force() accepts.
+int
+tunables_nstrategy(void)
+{
+	return STR_BULK + 1;
+}
+
+// Use strategy 'how' for every size class of memcpy, memmove and memset,
+// with bulk_copy and bulk_zero as the STR_BULK routines.
+void
+tunables_force(int how, void (*bulk_copy)(void *, const void *, size_t),
+	       void (*bulk_zero)(void *, size_t))
+{
+	int c;
+
+	if (!saved_valid) {
+		saved = string_tunables;
+		saved_valid = 1;
+	}
+	for (c = 0; c < STR_NCLASS; c++)
+		string_tunables.st_copy[c] = string_tunables.st_set[c] = how;
+	string_tunables.st_bulk_copy = bulk_copy;
+	string_tunables.st_bulk_zero = bulk_zero;
+}
+
+// Put back the tunables as they were before the first tunables_force().
+void
+tunables_restore(void)
+{
+	if (saved_valid)
+		string_tunables = saved;
+}